@@ -0,0 +1,453 @@
+// The MIT License (MIT)
+// 
+// Copyright (c) 2013 James Vecore
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Created by James Vecore
+// james.vecore@gmail.com
+
+
+/*
+The parts of the plugin that don't need Softimage or Krakatoa: the half conversions, the sRGB tables, the kernels
+that copy ICE channels into krakatoa's particle records and the scene read guard. They live in a header so the tests
+can build them on their own.
+*/
+
+#ifndef KRAKATOA_KERNELS_H
+#define KRAKATOA_KERNELS_H
+
+#include <cstring>
+#include <cstddef>
+#include <cmath>
+#include <string>
+#include <stdexcept>
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace XSI
+{
+	class CBaseICEAttributeDataArray;
+}
+
+// a particle index, the same 64 bit integer as krakatoasr::INT64
+typedef long long ParticleIndex;
+
+// Functions that use F16C or AVX2 are built for just that instruction set and only called once cpuid says it's there.
+// Everything else stays plain SSE2, so the build flags never let the compiler slip VEX code into the fallback paths.
+// (msvc doesn't need telling, it only emits what the intrinsics ask for)
+#ifdef _MSC_VER
+#define KRAKATOA_TARGET_F16C
+#define KRAKATOA_TARGET_AVX2
+#else
+#define KRAKATOA_TARGET_F16C __attribute__((target("f16c")))
+#define KRAKATOA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+inline void CpuID(int info[4], int leaf, int subleaf = 0)
+{
+#ifdef _MSC_VER
+	__cpuidex(info, leaf, subleaf);
+#else
+	__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+// only call this when cpuid says the OS has XSAVE turned on
+inline unsigned long long XGetBV()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+// float to half with round to nearest even, the same result the F16C instructions give
+inline unsigned short FloatToHalf(float value)
+{
+	unsigned int bits;
+	memcpy(&bits, &value, sizeof(bits));
+	unsigned int sign = (bits >> 16) & 0x8000;
+	bits &= 0x7FFFFFFF;
+
+	unsigned int half;
+	if (bits >= 0x47800000) // too big for a half, or Inf/NaN
+	{
+		half = bits > 0x7F800000 ? 0x7E00 : 0x7C00;
+	}
+	else if (bits < 0x38800000) // comes out as a denormal or 0, let the float add do the rounding
+	{
+		const unsigned int magicBits = 0x3F000000; // 0.5f lines the 10 mantissa bits up at the bottom
+		float magic, shifted;
+		memcpy(&magic, &magicBits, sizeof(magic));
+		memcpy(&shifted, &bits, sizeof(shifted));
+		shifted += magic;
+		memcpy(&bits, &shifted, sizeof(bits));
+		half = bits - magicBits;
+	}
+	else
+	{
+		unsigned int odd = (bits >> 13) & 1;
+		bits += 0xC8000FFF + odd; // rebias the exponent (-112 << 23) and round
+		half = bits >> 13;
+	}
+	return (unsigned short)(half | sign);
+}
+
+inline float HalfToFloat(unsigned short half)
+{
+	unsigned int sign     = (unsigned int)(half & 0x8000) << 16;
+	unsigned int exponent = (half >> 10) & 0x1F;
+	unsigned int mantissa = half & 0x3FF;
+	unsigned int bits;
+	if (exponent == 0x1F) // Inf/NaN
+	{
+		bits = sign | 0x7F800000 | (mantissa << 13);
+	}
+	else if (exponent == 0) // denormal or 0
+	{
+		float value = mantissa * (1.0f / 16777216.0f);
+		memcpy(&bits, &value, sizeof(bits));
+		bits |= sign;
+	}
+	else
+	{
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+	float result;
+	memcpy(&result, &bits, sizeof(result));
+	return result;
+}
+
+// F16C came along with AVX, so the OS has to be saving the AVX state as well
+inline bool HasF16C()
+{
+	int info[4];
+	CpuID(info, 1);
+	bool f16c    = (info[2] & (1 << 29)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	return f16c && osxsave && (XGetBV() & 6) == 6;
+}
+
+static const bool g_hasF16C = HasF16C();
+
+// Krakatoa works in linear space, need to convert to sRGB to show in viewport/image viewer
+inline unsigned char linearToSRGB(float v)
+{
+	if (v <= 0.0f)
+		return 0;
+	if (v >= 1.0f)
+		return 255;
+	if (v <= 0.0031308f)
+		return  (unsigned char)((12.92f * v * 255.0f) + 0.5f);
+	return (unsigned char)( ( ( 1.055f * std::pow(v, 1.0f / 2.4f ) ) - 0.055f ) * 255.0f + 0.5f);
+}
+
+/*
+Table driven version of linearToSRGB that gives exactly the same bytes without the pow.
+A coarse table indexed by the value gives the lowest code in that part of the range, and the value is then
+compared against the first linear value of the next code to see if it has crossed over (the table is fine
+enough that it never crosses more than one).
+*/
+class SRGBTable
+{
+public:
+	static const int COARSE_SIZE = 4096;
+	int coarse[COARSE_SIZE + 1];  // code of i / COARSE_SIZE, ints so the AVX2 path can gather them
+	float thresholds[257];        // smallest linear value that maps to each code, 256 is past the end of the range
+	unsigned short srgb16[COARSE_SIZE + 2]; // 16 bit sRGB of i / COARSE_SIZE, interpolated in between (padded for v == 1)
+	bool useAVX2;
+
+	SRGBTable()
+	{
+		for (int i = 0; i <= COARSE_SIZE; ++i)
+		{
+			coarse[i] = linearToSRGB((float)i / COARSE_SIZE);
+			double v = (double)i / COARSE_SIZE;
+			double encoded = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055;
+			srgb16[i] = (unsigned short)(encoded * 65535.0 + 0.5);
+		}
+		srgb16[COARSE_SIZE + 1] = srgb16[COARSE_SIZE];
+
+		// positive floats sort the same as their bit patterns so the thresholds can be found by bisecting those
+		thresholds[0] = 0.0f;
+		for (int code = 1; code < 256; ++code)
+		{
+			unsigned int lo = 0;          // 0.0f
+			unsigned int hi = 0x3F800000; // 1.0f
+			while (lo < hi)
+			{
+				unsigned int mid = lo + (hi - lo) / 2;
+				float v;
+				memcpy(&v, &mid, sizeof(v));
+				if (linearToSRGB(v) >= code)
+					hi = mid;
+				else
+					lo = mid + 1;
+			}
+			memcpy(&thresholds[code], &lo, sizeof(float));
+		}
+		thresholds[256] = 2.0f; // values are clamped to 1 first
+
+		int info[4];
+		CpuID(info, 1);
+		bool avx = (info[2] & (1 << 28)) != 0 && (info[2] & (1 << 27)) != 0 && (XGetBV() & 6) == 6;
+		CpuID(info, 7);
+		useAVX2 = avx && (info[1] & (1 << 5)) != 0;
+	}
+
+	unsigned char ToSRGB(float v) const
+	{
+		v = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f; // NaN goes to 0 as well
+		int code = coarse[(int)(v * COARSE_SIZE)];
+		if (v >= thresholds[code + 1])
+			code++;
+		return (unsigned char)code;
+	}
+
+	// within about a code of the exact curve, plenty for display
+	unsigned short ToSRGB16(float v) const
+	{
+		v = v > 0.0f ? (v < 1.0f ? v : 1.0f) * COARSE_SIZE : 0.0f;
+		int i = (int)v;
+		float t = v - i;
+		return (unsigned short)(srgb16[i] + (srgb16[i + 1] - srgb16[i]) * t + 0.5f);
+	}
+};
+
+// A ChannelCopier moves one mapped ICE attribute into its slot in krakatoa's particle record.
+// They are resolved once per channel in ScanForChannels so get_next_particle never has to ask the SDK
+// what type an attribute is, it just runs the list of copiers.
+// copy does a single particle, pack does a whole block of particles into interleaved records.
+struct ChannelCopier;
+typedef void (*ChannelCopyFunc)(const ChannelCopier& copier, ParticleIndex index, char* pParticle);
+typedef void (*ChannelPackFunc)(const ChannelCopier& copier, ParticleIndex first, ParticleIndex count, char* pRecords, size_t recordStride);
+
+struct ChannelCopier
+{
+	ChannelCopyFunc copy;
+	ChannelPackFunc pack;
+	const char* pSource;                    // first element of the ICE data array
+	size_t sourceStride;                    // size of one ICE element, or 0 if the array is constant
+	int byteOffset;                         // where the channel lives in the krakatoa particle
+	int dataSize;                           // bytes written into the particle
+	XSI::CBaseICEAttributeDataArray* pDataArray; // only needed by the types that can't be copied directly
+};
+
+// the ICE element starts with exactly what krakatoa wants (Color4 -> RGB is just the first 3 floats)
+template <class TChannel, int Arity>
+void CopyChannelDirect(const ChannelCopier& copier, ParticleIndex index, char* pParticle)
+{
+	memcpy(pParticle + copier.byteOffset, copier.pSource + index * copier.sourceStride, Arity * sizeof(TChannel));
+}
+
+// fallback for the types that need converting, just runs the single particle copy over the block
+inline void PackChannelGeneric(const ChannelCopier& copier, ParticleIndex first, ParticleIndex count, char* pRecords, size_t recordStride)
+{
+	for (ParticleIndex i = 0; i < count; ++i)
+		copier.copy(copier, first + i, pRecords + i * recordStride);
+}
+
+// constant arrays are the same value for every particle, just splat it into each record
+inline void PackChannelConstant(const ChannelCopier& copier, ParticleIndex /*first*/, ParticleIndex count, char* pRecords, size_t recordStride)
+{
+	char* pOut = pRecords + copier.byteOffset;
+	for (ParticleIndex i = 0; i < count; ++i, pOut += recordStride)
+		memcpy(pOut, copier.pSource, copier.dataSize);
+}
+
+// The pack kernels below transpose a block of one ICE channel (structure of arrays) into the interleaved
+// staging records (array of structures). They rely on two things set up by the stream:
+//  - channels are packed in increasing byteOffset order
+//  - recordStride has at least 4 bytes of padding past the last channel
+// so a 16 byte store that runs past the end of a 3 float channel only ever lands on bytes that get written later.
+
+// scalar channels, load 4 particles at once and scatter each lane into its record
+inline void PackChannelFloat1(const ChannelCopier& copier, ParticleIndex first, ParticleIndex count, char* pRecords, size_t recordStride)
+{
+	const float* pSrc = (const float*)copier.pSource + first;
+	char* pOut = pRecords + copier.byteOffset;
+
+	ParticleIndex i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 v = _mm_loadu_ps(pSrc + i);
+		_mm_store_ss((float*)pOut, v);
+		pOut += recordStride;
+		_mm_store_ss((float*)pOut, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+		pOut += recordStride;
+		_mm_store_ss((float*)pOut, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)));
+		pOut += recordStride;
+		_mm_store_ss((float*)pOut, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)));
+		pOut += recordStride;
+	}
+	for (; i < count; ++i, pOut += recordStride)
+		*(float*)pOut = pSrc[i];
+}
+
+// vector channels, one unaligned 16 byte move per particle
+// (the last particle of a block is done with a plain copy so we never read past the end of a Vector3f array)
+template <int Arity>
+void PackChannelFloatN(const ChannelCopier& copier, ParticleIndex first, ParticleIndex count, char* pRecords, size_t recordStride)
+{
+	const char* pSrc = copier.pSource + first * copier.sourceStride;
+	char* pOut = pRecords + copier.byteOffset;
+
+	ParticleIndex i = 0;
+	for (; i + 1 < count; ++i, pSrc += copier.sourceStride, pOut += recordStride)
+		_mm_storeu_ps((float*)pOut, _mm_loadu_ps((const float*)pSrc));
+	if (i < count)
+		memcpy(pOut, pSrc, Arity * sizeof(float));
+}
+
+template <int Arity>
+void CopyChannelHalf(const ChannelCopier& copier, ParticleIndex index, char* pParticle)
+{
+	const float* pIn = (const float*)(copier.pSource + index * copier.sourceStride);
+	unsigned short* pOut = (unsigned short*)(pParticle + copier.byteOffset);
+	for (int i = 0; i < Arity; ++i)
+		pOut[i] = FloatToHalf(pIn[i]);
+}
+
+// the F16C part of PackChannelHalf1, does whole groups of 4 and returns how many particles it packed
+KRAKATOA_TARGET_F16C inline ParticleIndex PackHalf1_F16C(const float* pSrc, ParticleIndex count, char* pOut, size_t recordStride)
+{
+	ParticleIndex i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i h = _mm_cvtps_ph(_mm_loadu_ps(pSrc + i), _MM_FROUND_TO_NEAREST_INT);
+		*(unsigned short*)pOut = (unsigned short)_mm_extract_epi16(h, 0);
+		pOut += recordStride;
+		*(unsigned short*)pOut = (unsigned short)_mm_extract_epi16(h, 1);
+		pOut += recordStride;
+		*(unsigned short*)pOut = (unsigned short)_mm_extract_epi16(h, 2);
+		pOut += recordStride;
+		*(unsigned short*)pOut = (unsigned short)_mm_extract_epi16(h, 3);
+		pOut += recordStride;
+	}
+	return i;
+}
+
+// the F16C part of PackChannelHalfN, everything but the last particle
+KRAKATOA_TARGET_F16C inline ParticleIndex PackHalfN_F16C(const char* pSrc, size_t sourceStride, ParticleIndex count, char* pOut, size_t recordStride)
+{
+	ParticleIndex i = 0;
+	for (; i + 1 < count; ++i, pSrc += sourceStride, pOut += recordStride)
+		_mm_storel_epi64((__m128i*)pOut, _mm_cvtps_ph(_mm_loadu_ps((const float*)pSrc), _MM_FROUND_TO_NEAREST_INT));
+	return i;
+}
+
+// scalar float channels going into halves, 4 particles per conversion
+inline void PackChannelHalf1(const ChannelCopier& copier, ParticleIndex first, ParticleIndex count, char* pRecords, size_t recordStride)
+{
+	const float* pSrc = (const float*)(copier.pSource + first * copier.sourceStride);
+	char* pOut = pRecords + copier.byteOffset;
+
+	ParticleIndex i = 0;
+	if (g_hasF16C && copier.sourceStride == sizeof(float))
+	{
+		i = PackHalf1_F16C(pSrc, count, pOut, recordStride);
+		pOut += i * recordStride;
+	}
+	for (; i < count; ++i, pOut += recordStride)
+		*(unsigned short*)pOut = FloatToHalf(*(const float*)((const char*)pSrc + i * copier.sourceStride));
+}
+
+// vector channels going into halves, one 8 byte store per particle
+// (same spill past the channel and the same plain copy of the last particle as PackChannelFloatN)
+template <int Arity>
+void PackChannelHalfN(const ChannelCopier& copier, ParticleIndex first, ParticleIndex count, char* pRecords, size_t recordStride)
+{
+	const char* pSrc = copier.pSource + first * copier.sourceStride;
+	char* pOut = pRecords + copier.byteOffset;
+
+	ParticleIndex i = 0;
+	if (g_hasF16C && (copier.sourceStride != 0 || Arity == 4)) // a constant array only holds one element to read 16 bytes from
+	{
+		i = PackHalfN_F16C(pSrc, copier.sourceStride, count, pOut, recordStride);
+		pSrc += i * copier.sourceStride;
+		pOut += i * recordStride;
+	}
+	for (; i < count; ++i, pSrc += copier.sourceStride, pOut += recordStride)
+	{
+		for (int j = 0; j < Arity; ++j)
+			((unsigned short*)pOut)[j] = FloatToHalf(((const float*)pSrc)[j]);
+	}
+}
+
+/*
+Makes sure the scene is only read while it's locked. The plugin calls NoteRead where each kind of scene read starts
+(scanning a cloud, fetching an ICE array, the scene index, visibility, lights, occlusion meshes), which counts the reads
+and throws once the scene has been unlocked, so a read that slipped past the unlock fails the render instead of racing
+Softimage. It only sees those calls: SDK calls in between them and SDK objects being destroyed aren't counted, those are
+kept before the unlock by hand. The lock and the reads all happen on the thread Softimage calls the plugin on.
+*/
+class SceneReadGuard
+{
+protected:
+	volatile bool locked;
+	long reads; // since the scene was last locked
+
+public:
+	SceneReadGuard() :
+		locked(false),
+		reads(0)
+	{
+	}
+
+	void Lock()
+	{
+		locked = true;
+		reads  = 0;
+	}
+
+	void Unlock()
+	{
+		locked = false;
+	}
+
+	bool IsLocked() const
+	{
+		return locked;
+	}
+
+	long GetReads() const
+	{
+		return reads;
+	}
+
+	// what names the accessor, it ends up in the error
+	void NoteRead(const char* what)
+	{
+		if (locked == false)
+			throw std::runtime_error(std::string("scene data read after it was unlocked: ") + what);
+		reads++;
+	}
+};
+
+#endif
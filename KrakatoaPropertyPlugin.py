@@ -132,6 +132,32 @@ def KrakatoaOptions_Define( in_ctxt ):
     oCustomProperty.AddParameter3("ComputeLighting"                 ,constants.siBool  ,True)
     oCustomProperty.AddParameter3("PrtPathExpression"               ,constants.siString,"")
 
+    # performance
+    oCustomProperty.AddParameter3("PipelinedIngestion"              ,constants.siBool  ,True)
+    oCustomProperty.AddParameter3("IngestionThreads"                ,constants.siInt4  ,0,0,256) # 0 = one per core
+    oCustomProperty.AddParameter3("UnlockSceneEarly"                ,constants.siBool  ,False) # copy the ICE data so the scene is unlocked before rendering, costs as much memory again
+    oCustomProperty.AddParameter3("FoldConstantChannels"            ,constants.siBool  ,True) # ignored when saving a prt
+    oCustomProperty.AddParameter3("ChannelPrecision"                ,constants.siInt4  ,0) # Float = 0, Half Float For Shading Channels = 1
+    oCustomProperty.AddParameter3("CacheParticles"                  ,constants.siBool  ,False) # keep ICE data between renders
+    oCustomProperty.AddParameter3("ParticleCacheSize"               ,constants.siInt4  ,4096,0,None) # MB
+    oCustomProperty.AddParameter3("ICEReadsCamera"                  ,constants.siBool  ,True) # off: camera changes don't invalidate cached clouds and meshes
+    oCustomProperty.AddParameter3("CacheOcclusionMeshes"            ,constants.siBool  ,True) # reuse occlusion meshes whose geometry hasn't changed
+    oCustomProperty.AddParameter3("InteractiveSession"              ,constants.siBool  ,False) # previews keep the renderer and cached particles between renders
+    oCustomProperty.AddParameter3("ViewerUpdateRate"                ,constants.siDouble,4.0,0.0,None) # viewer updates per second, 0 = as often as krakatoa sends them
+    oCustomProperty.AddParameter3("ProgressivePreview"              ,constants.siBool  ,False) # previews render a quick low resolution pass first
+    oCustomProperty.AddParameter3("PreviewPassScale"                ,constants.siInt4  ,4) # 1/2 Resolution = 2, 1/4 Resolution = 4
+    oCustomProperty.AddParameter3("ParticleLOD"                     ,constants.siInt4  ,0) # Off = 0, Keep Ratio = 1, Particle Budget = 2, ignored when saving a prt
+    oCustomProperty.AddParameter3("LODRatio"                        ,constants.siDouble,0.5,0.0,1.0) # fraction of the particles kept
+    oCustomProperty.AddParameter3("LODBudget"                       ,constants.siInt4  ,10000000,0,None) # particles kept across all clouds
+    oCustomProperty.AddParameter3("MergeDenseParticles"             ,constants.siBool  ,False) # ignored when saving a prt
+    oCustomProperty.AddParameter3("MergeCellSize"                   ,constants.siDouble,1.0,0.0,None) # pixels
+    oCustomProperty.AddParameter3("MergeMaxPerCell"                 ,constants.siInt4  ,4,1,None) # particles a cell keeps before it is merged
+    oCustomProperty.AddParameter3("CullingMode"                     ,constants.siInt4  ,0) # Off = 0, Camera Only (keeps shadow casters) = 1, Camera Frustum = 2
+    oCustomProperty.AddParameter3("CullingMargin"                   ,constants.siDouble,1.0,0.0,None)
+    oCustomProperty.AddParameter3("CullOcclusionMeshes"             ,constants.siBool  ,False) # drop occluder triangles outside the camera and light volumes
+    oCustomProperty.AddParameter3("RejectEmptyParticles"            ,constants.siBool  ,False) # zero density (unless additive), NaN/Inf positions
+    oCustomProperty.AddParameter3("RejectTransparentParticles"      ,constants.siBool  ,False) # Color alpha of 0, krakatoa ignores alpha otherwise
+
     return True
 
 # Tip: Use the "Refresh" option on the Property Page context menu to 
@@ -147,6 +173,10 @@ def KrakatoaOptions_DefineLayout( in_ctxt ):
     shaders          = ["Isotropic",0, "Phong"  , 1,"Henyey-Greenstein",2,"Schlick",3,"Kajiya-Kay Hair",4,"Marschner Hair",5]
     compressionTypes = ["None",0, "RLE",1, "ZIPS (Single Scanline)",2, "ZIP (Multi-scanline)",3, "PIZ", 4, "PXR24", 5, "B44", 6, "B44A", 7]
     dataTypes        = ["Unsigned Integer (32-bit)",0, "Half Float (16-bit)", 1, "Float (32-bit)", 2]
+    cullingModes     = ["Off",0, "Camera Only (Keep Shadow Casters)",1, "Camera Frustum",2]
+    precisions       = ["Float (32-bit)",0, "Half Float For Shading Channels (16-bit)",1]
+    previewScales    = ["1/2 Resolution",2, "1/4 Resolution",4]
+    lodModes         = ["Off",0, "Keep Ratio",1, "Particle Budget",2]
 
     oLayout.AddEnumControl("RenderingMethod"    ,renderingMethods, "Rendering Method")
 
@@ -242,6 +272,49 @@ def KrakatoaOptions_DefineLayout( in_ctxt ):
     oItem.SetAttribute("OpenFile", False)
     oItem.SetAttribute("MustExist", False)
 
+    oLayout.AddTab("Performance")
+    oLayout.AddGroup("Particle Loading",True)
+    oLayout.AddItem("PipelinedIngestion", "Pack Particles On Worker Threads")
+    oLayout.AddItem("IngestionThreads", "Worker Threads (0 = Auto)")
+    oLayout.AddItem("UnlockSceneEarly", "Copy ICE Data To Unlock The Scene Early")
+    oLayout.AddItem("FoldConstantChannels", "Fold Constant Channels Into Render Settings")
+    oLayout.AddEnumControl("ChannelPrecision", precisions, "Channel Precision")
+    oLayout.EndGroup()
+
+    oLayout.AddGroup("Particle Cache",True)
+    oLayout.AddItem("CacheParticles", "Keep Particles Between Renders")
+    oLayout.AddItem("ParticleCacheSize", "Cache Size (MB)")
+    oLayout.AddItem("ICEReadsCamera", "ICE Trees Read The Camera")
+    oLayout.AddItem("CacheOcclusionMeshes", "Keep Occlusion Meshes Between Renders")
+    oLayout.AddItem("InteractiveSession", "Interactive Preview Session")
+    oLayout.EndGroup()
+
+    oLayout.AddGroup("Viewer",True)
+    oLayout.AddItem("ViewerUpdateRate", "Max Updates Per Second (0 = No Limit)")
+    oLayout.AddItem("ProgressivePreview", "Progressive Preview")
+    oLayout.AddEnumControl("PreviewPassScale", previewScales, "Preview Pass")
+    oLayout.EndGroup()
+
+    oLayout.AddGroup("Level Of Detail",True)
+    oLayout.AddEnumControl("ParticleLOD", lodModes, "Mode")
+    oLayout.AddItem("LODRatio", "Fraction Of Particles Kept")
+    oLayout.AddItem("LODBudget", "Particle Budget")
+    oLayout.EndGroup()
+
+    oLayout.AddGroup("Particle Merging",True)
+    oLayout.AddItem("MergeDenseParticles", "Merge Crowded Particles")
+    oLayout.AddItem("MergeCellSize", "Cell Size (Pixels)")
+    oLayout.AddItem("MergeMaxPerCell", "Max Particles Per Cell")
+    oLayout.EndGroup()
+
+    oLayout.AddGroup("Particle Culling",True)
+    oLayout.AddEnumControl("CullingMode", cullingModes, "Culling Mode")
+    oLayout.AddItem("CullingMargin", "Margin")
+    oLayout.AddItem("CullOcclusionMeshes", "Cull Occlusion Mesh Triangles")
+    oLayout.AddItem("RejectEmptyParticles", "Drop Zero Density / Invalid Particles")
+    oLayout.AddItem("RejectTransparentParticles", "Drop Particles With Zero Color Alpha")
+    oLayout.EndGroup()
+
 
     return True
 
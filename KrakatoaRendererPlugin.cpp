@@ -59,6 +59,7 @@
 #include <xsi_shader.h>
 #include <xsi_shaderparameter.h>
 #include <xsi_sceneitem.h>
+#include <xsi_parameter.h>
 
 #include <krakatoasr_progress.hpp>
 #include <krakatoasr_renderer.hpp>
@@ -67,8 +68,21 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 
+#include <cstdio>
+#include <cmath>
+#include <cfloat>
+#include <stdexcept>
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <intrin.h>
+#include <process.h>
+
+#include "KrakatoaKernels.h"
+
 using namespace XSI; 
 using namespace krakatoasr;
 using namespace std;
@@ -78,27 +92,13 @@ using namespace std;
 static volatile bool g_shouldAbort = false; 
 
 
-class SIProgressLogger : public progress_logger_interface 
+// CValue only holds 32 bit integers, so particle counts (which can go past 4G) are printed with this
+CString CountText(krakatoasr::INT64 count)
 {
-    RendererContext& ctx;
-    CString curTitle;
-public:
-    SIProgressLogger(RendererContext& ctx) : ctx(ctx)
-    {
-    
-    }
-    virtual ~SIProgressLogger() {}
-	virtual void set_title( const char* title )
-    {
-        curTitle = title;
-        ctx.ProgressUpdate(curTitle, curTitle, 0);
-    }
-
-	virtual void set_progress( float progress )
-    {
-        ctx.ProgressUpdate(curTitle, curTitle, (int)(progress * 100.0f));
-    }
-};
+	char buff[24];
+	sprintf(buff, "%lld", (long long)count);
+	return CString(buff);
+}
 
 class SICancelRenderInterface : public cancel_render_interface 
 {
@@ -118,21 +118,192 @@ struct RGBA
     unsigned char a;
 };
 
-// Krakatoa works in linear space, need to convert to sRGB to show in viewport/image viewer
-inline unsigned char linearToSRGB(float v)
+static const SRGBTable g_srgbTable;
+
+// alpha is just scaled, krakatoa keeps an alpha per color channel so show their average
+inline unsigned char AverageAlpha(const frame_buffer_pixel_data& pixel)
 {
-	if (v <= 0.0f)
-		return 0;
-	if (v >= 1.0f)
-		return 255;
-	if (v <= 0.0031308f)
-		return  (unsigned char)((12.92f * v * 255.0f) + 0.5f);
-	return (unsigned char)( ( ( 1.055f * pow(v, 1.0f / 2.4f ) ) - 0.055f ) * 255.0f + 0.5f);
+	float a = (pixel.r_alpha + pixel.g_alpha + pixel.b_alpha) / 3.0f;
+	return (unsigned char)(a > 0.0f ? (a < 1.0f ? a * 255.0f : 255.0f) : 0.0f);
+}
+
+// 8 pixels at a time, the channels are pulled out of krakatoa's pixels and the tables read with gathers
+KRAKATOA_TARGET_AVX2 void ConvertScanlineToRGBA8_AVX2(const frame_buffer_pixel_data* pIn, unsigned int count, RGBA* pOut)
+{
+	const SRGBTable& table = g_srgbTable;
+	const int pixelFloats = sizeof(frame_buffer_pixel_data) / sizeof(float);
+	const __m256i pixelOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(pixelFloats));
+	const __m256 zero  = _mm256_setzero_ps();
+	const __m256 one   = _mm256_set1_ps(1.0f);
+	const __m256 scale = _mm256_set1_ps((float)SRGBTable::COARSE_SIZE);
+	const __m256i step = _mm256_set1_epi32(1);
+
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		const float* pBase = (const float*)(pIn + i);
+		__m256i codes[3];
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			__m256 v = _mm256_i32gather_ps(pBase + channel, pixelOffsets, 4);
+			v = _mm256_min_ps(_mm256_max_ps(v, zero), one); // max picks 0 for NaN
+			__m256i code = _mm256_i32gather_epi32(table.coarse, _mm256_cvttps_epi32(_mm256_mul_ps(v, scale)), 4);
+			__m256 next = _mm256_i32gather_ps(table.thresholds, _mm256_add_epi32(code, step), 4);
+			codes[channel] = _mm256_sub_epi32(code, _mm256_castps_si256(_mm256_cmp_ps(v, next, _CMP_GE_OQ))); // true is -1
+		}
+
+		__m256 alpha = _mm256_add_ps(_mm256_add_ps(_mm256_i32gather_ps(pBase + 3, pixelOffsets, 4), _mm256_i32gather_ps(pBase + 4, pixelOffsets, 4)),
+		                             _mm256_i32gather_ps(pBase + 5, pixelOffsets, 4));
+		alpha = _mm256_div_ps(alpha, _mm256_set1_ps(3.0f));
+		alpha = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(alpha, zero), one), _mm256_set1_ps(255.0f));
+		__m256i a = _mm256_cvttps_epi32(alpha);
+
+		__m256i rgba = _mm256_or_si256(_mm256_or_si256(codes[0], _mm256_slli_epi32(codes[1], 8)),
+		                               _mm256_or_si256(_mm256_slli_epi32(codes[2], 16), _mm256_slli_epi32(a, 24)));
+		_mm256_storeu_si256((__m256i*)(pOut + i), rgba);
+	}
+	for (; i < count; ++i)
+	{
+		pOut[i].r = table.ToSRGB(pIn[i].r);
+		pOut[i].g = table.ToSRGB(pIn[i].g);
+		pOut[i].b = table.ToSRGB(pIn[i].b);
+		pOut[i].a = AverageAlpha(pIn[i]);
+	}
+}
+
+// 8 pixels at a time like the 8 bit version, one gather brings in both table entries a value is interpolated between
+KRAKATOA_TARGET_AVX2 void ConvertScanlineToRGBA16_AVX2(const frame_buffer_pixel_data* pIn, unsigned int count, unsigned short* pOut)
+{
+	const SRGBTable& table = g_srgbTable;
+	const int pixelFloats = sizeof(frame_buffer_pixel_data) / sizeof(float);
+	const __m256i pixelOffsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(pixelFloats));
+	const __m256 zero  = _mm256_setzero_ps();
+	const __m256 one   = _mm256_set1_ps(1.0f);
+	const __m256 half  = _mm256_set1_ps(0.5f);
+	const __m256 scale = _mm256_set1_ps((float)SRGBTable::COARSE_SIZE);
+	const __m256i low  = _mm256_set1_epi32(0xFFFF);
+
+	unsigned int i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		const float* pBase = (const float*)(pIn + i);
+		__m256i values[4];
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			__m256 v = _mm256_i32gather_ps(pBase + channel, pixelOffsets, 4);
+			v = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(v, zero), one), scale); // max picks 0 for NaN
+			__m256i index = _mm256_cvttps_epi32(v);
+			__m256 t = _mm256_sub_ps(v, _mm256_cvtepi32_ps(index));
+			// srgb16[index] in the low half, srgb16[index + 1] in the high half (the table is padded for index == COARSE_SIZE)
+			__m256i pair = _mm256_i32gather_epi32((const int*)table.srgb16, index, 2);
+			__m256 lo = _mm256_cvtepi32_ps(_mm256_and_si256(pair, low));
+			__m256 hi = _mm256_cvtepi32_ps(_mm256_srli_epi32(pair, 16));
+			values[channel] = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_add_ps(lo, _mm256_mul_ps(_mm256_sub_ps(hi, lo), t)), half));
+		}
+
+		__m256 alpha = _mm256_add_ps(_mm256_add_ps(_mm256_i32gather_ps(pBase + 3, pixelOffsets, 4), _mm256_i32gather_ps(pBase + 4, pixelOffsets, 4)),
+		                             _mm256_i32gather_ps(pBase + 5, pixelOffsets, 4));
+		alpha = _mm256_div_ps(alpha, _mm256_set1_ps(3.0f));
+		alpha = _mm256_add_ps(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(alpha, zero), one), _mm256_set1_ps(65535.0f)), half);
+		values[3] = _mm256_cvttps_epi32(alpha);
+
+		// rg and ba pairs, interleaved into whole pixels and put back in order across the two lanes
+		__m256i rg = _mm256_or_si256(values[0], _mm256_slli_epi32(values[1], 16));
+		__m256i ba = _mm256_or_si256(values[2], _mm256_slli_epi32(values[3], 16));
+		__m256i first  = _mm256_unpacklo_epi32(rg, ba); // pixels 0 1 4 5
+		__m256i second = _mm256_unpackhi_epi32(rg, ba); // pixels 2 3 6 7
+		_mm256_storeu_si256((__m256i*)(pOut + i * 4), _mm256_permute2x128_si256(first, second, 0x20));
+		_mm256_storeu_si256((__m256i*)(pOut + i * 4 + 16), _mm256_permute2x128_si256(first, second, 0x31));
+	}
+	for (; i < count; ++i)
+	{
+		unsigned short* pPixel = pOut + i * 4;
+		pPixel[0] = table.ToSRGB16(pIn[i].r);
+		pPixel[1] = table.ToSRGB16(pIn[i].g);
+		pPixel[2] = table.ToSRGB16(pIn[i].b);
+		float a = (pIn[i].r_alpha + pIn[i].g_alpha + pIn[i].b_alpha) / 3.0f;
+		pPixel[3] = (unsigned short)(a > 0.0f ? (a < 1.0f ? a * 65535.0f + 0.5f : 65535.0f) : 0.0f);
+	}
+}
+
+// 16 bit integers are still display values so they get the sRGB curve as well
+void ConvertScanlineToRGBA16(const frame_buffer_pixel_data* pIn, unsigned int count, unsigned short* pOut)
+{
+	const SRGBTable& table = g_srgbTable;
+	if (table.useAVX2)
+	{
+		ConvertScanlineToRGBA16_AVX2(pIn, count, pOut);
+		return;
+	}
+	for (unsigned int i = 0; i < count; ++i, pOut += 4)
+	{
+		pOut[0] = table.ToSRGB16(pIn[i].r);
+		pOut[1] = table.ToSRGB16(pIn[i].g);
+		pOut[2] = table.ToSRGB16(pIn[i].b);
+		float a = (pIn[i].r_alpha + pIn[i].g_alpha + pIn[i].b_alpha) / 3.0f;
+		pOut[3] = (unsigned short)(a > 0.0f ? (a < 1.0f ? a * 65535.0f + 0.5f : 65535.0f) : 0.0f);
+	}
+}
+
+// float output stays linear, r g b and the first alpha come across in one move and the alpha is patched
+void ConvertScanlineToRGBA32F(const frame_buffer_pixel_data* pIn, unsigned int count, float* pOut)
+{
+	for (unsigned int i = 0; i < count; ++i, pOut += 4)
+	{
+		_mm_storeu_ps(pOut, _mm_loadu_ps(&pIn[i].r));
+		pOut[3] = (pIn[i].r_alpha + pIn[i].g_alpha + pIn[i].b_alpha) / 3.0f;
+	}
+}
+
+KRAKATOA_TARGET_F16C void ConvertScanlineToRGBA16F_F16C(const frame_buffer_pixel_data* pIn, unsigned int count, unsigned short* pOut)
+{
+	for (unsigned int i = 0; i < count; ++i, pOut += 4)
+	{
+		float a = (pIn[i].r_alpha + pIn[i].g_alpha + pIn[i].b_alpha) / 3.0f;
+		_mm_storel_epi64((__m128i*)pOut, _mm_cvtps_ph(_mm_loadu_ps(&pIn[i].r), _MM_FROUND_TO_NEAREST_INT));
+		pOut[3] = FloatToHalf(a);
+	}
+}
+
+void ConvertScanlineToRGBA16F(const frame_buffer_pixel_data* pIn, unsigned int count, unsigned short* pOut)
+{
+	if (g_hasF16C)
+	{
+		ConvertScanlineToRGBA16F_F16C(pIn, count, pOut);
+		return;
+	}
+	for (unsigned int i = 0; i < count; ++i, pOut += 4)
+	{
+		float a = (pIn[i].r_alpha + pIn[i].g_alpha + pIn[i].b_alpha) / 3.0f;
+		pOut[0] = FloatToHalf(pIn[i].r);
+		pOut[1] = FloatToHalf(pIn[i].g);
+		pOut[2] = FloatToHalf(pIn[i].b);
+		pOut[3] = FloatToHalf(a);
+	}
+}
+
+// converts a run of krakatoa's linear pixels into the 8 bit sRGB softimage shows
+void ConvertScanlineToRGBA8(const frame_buffer_pixel_data* pIn, unsigned int count, RGBA* pOut)
+{
+	const SRGBTable& table = g_srgbTable;
+	if (table.useAVX2)
+	{
+		ConvertScanlineToRGBA8_AVX2(pIn, count, pOut);
+		return;
+	}
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		pOut[i].r = table.ToSRGB(pIn[i].r);
+		pOut[i].g = table.ToSRGB(pIn[i].g);
+		pOut[i].b = table.ToSRGB(pIn[i].b);
+		pOut[i].a = AverageAlpha(pIn[i]);
+	}
 }
 
 /*
 KaraktoaSR only gives updates to the frame buffer all at once (full image) even if its not all filled out
 this fragment will update either the full image or just the crop window
+the source is where the fragment's pixels start in krakatoa's image, the same as the offset unless krakatoa only rendered the crop window
 */
 class KrakFragment : public RendererImageFragment
 {
@@ -143,6 +314,8 @@ private:
     unsigned int fragHeight;
     unsigned int offsetX; // offset from the left
     unsigned int offsetY; // offset from the bottom
+    unsigned int sourceX;
+    unsigned int sourceY;
     const frame_buffer_pixel_data* pLastData;
 public:
 
@@ -153,6 +326,21 @@ public:
         krakHeight(0),
         offsetX(offsetX),
         offsetY(offsetY),
+        sourceX(offsetX),
+        sourceY(offsetY),
+        pLastData(0)
+    {
+    }
+
+    KrakFragment(unsigned int fragWidth, unsigned int fragHeight, unsigned int offsetX, unsigned int offsetY, unsigned int sourceX, unsigned int sourceY) : 
+        fragWidth(fragWidth), 
+        fragHeight(fragHeight),
+        krakWidth(0),
+        krakHeight(0),
+        offsetX(offsetX),
+        offsetY(offsetY),
+        sourceX(sourceX),
+        sourceY(sourceY),
         pLastData(0)
     {
     }
@@ -173,6 +361,8 @@ public:
 	unsigned int GetOffsetY() const { return offsetY; }
 	unsigned int GetWidth()   const { return fragWidth;   }
 	unsigned int GetHeight()  const { return fragHeight;  }
+	unsigned int GetSourceX() const { return sourceX; }
+	unsigned int GetSourceY() const { return sourceY; }
     
 	bool GetScanlineRGBA( unsigned int in_uiRow, siImageBitDepth in_eBitDepth, unsigned char *out_pScanline ) const
 
@@ -183,56 +373,408 @@ public:
         if (pLastData == 0)
             return false;
 
-        // default when showing to user is the siImageBitDepthInteger8 RGBA packed into a single integer
-        // we need to convert krakatoa's floating point pixels into rgba
-		RGBA* pScanline = (RGBA*)out_pScanline;
+        // softimage references data from bottom left up, and krakatoa's rows are indexed from the bottom the same way
+        // (the plugin has always read them like that), so there is no flip: a scanline is one offset into the buffer
+
+        unsigned int krakY       = sourceY + in_uiRow; // offset for this scanline from the bottom of krakatoa's image
+        unsigned int krakXStart  = sourceX;
+
+        // the row is contiguous in krakatoa's buffer so it goes through the conversion in one go
+        const frame_buffer_pixel_data* pRow = &this->pLastData[krakXStart + krakY*krakWidth];
+        switch (in_eBitDepth)
+        {
+        case siImageBitDepthInteger8:
+            // default when showing to user is the siImageBitDepthInteger8 RGBA packed into a single integer
+            ConvertScanlineToRGBA8(pRow, fragWidth, (RGBA*)out_pScanline);
+            break;
+        case siImageBitDepthInteger16:
+            ConvertScanlineToRGBA16(pRow, fragWidth, (unsigned short*)out_pScanline);
+            break;
+        case siImageBitDepthFloat16:
+            ConvertScanlineToRGBA16F(pRow, fragWidth, (unsigned short*)out_pScanline);
+            break;
+        case siImageBitDepthFloat32:
+            ConvertScanlineToRGBA32F(pRow, fragWidth, (float*)out_pScanline);
+            break;
+        default:
+            return false;
+        }
+
+		return true;
+	}
+};
+
+// scrambles a particle index, used to pick a subset of particles that is spread evenly over the whole cloud
+// subsets picked with different seeds don't line up with each other
+inline unsigned int HashIndex(unsigned __int64 index, unsigned __int64 seed = 0)
+{
+	index += seed * 0x9E3779B97F4A7C15ULL;
+	index ^= index >> 33;
+	index *= 0xFF51AFD7ED558CCDULL;
+	index ^= index >> 33;
+	index *= 0xC4CEB9FE1A85EC53ULL;
+	index ^= index >> 33;
+	return (unsigned int)index;
+}
+
+// scoped lock for a CRITICAL_SECTION, same idea as LockRendererData
+class ScopedCriticalSection
+{
+	CRITICAL_SECTION& cs;
+public:
+	ScopedCriticalSection(CRITICAL_SECTION& cs) : cs(cs)
+	{
+		EnterCriticalSection(&cs);
+	}
+	~ScopedCriticalSection()
+	{
+		LeaveCriticalSection(&cs);
+	}
+};
 
-        // assume kraktoa data is layed out from top-left to bottom right
-        // softimage references data from bottom left up
+// quick 64 bit hash of a buffer, only used to tell whether something changed since the last time we looked
+unsigned __int64 HashBytes(const char* pData, size_t size, unsigned __int64 hash)
+{
+	const size_t words = size / sizeof(unsigned __int64);
+	const unsigned __int64* pWords = (const unsigned __int64*)pData;
+	for (size_t i = 0; i < words; ++i)
+	{
+		hash = (hash ^ pWords[i]) * 0x100000001B3ULL;
+		hash ^= hash >> 29;
+	}
+	for (size_t i = words * sizeof(unsigned __int64); i < size; ++i)
+		hash = (hash ^ (unsigned char)pData[i]) * 0x100000001B3ULL;
+	return hash;
+}
 
-        unsigned int fullOffsetY = offsetY + in_uiRow; // full offset for this scanline from the bottom
-        unsigned int krakY       = fullOffsetY;
-        unsigned int krakXStart  = offsetX; // x is the same for krak and frag
+/*
+Gets images and progress from krakatoa over to softimage without ever holding up the render.
+Krakatoa's callbacks copy the image into the back buffer (or note the progress), a presenter thread swaps the buffers
+and converts the newest image at most maxRate times a second. Updates that come in faster than that are coalesced,
+only the latest image gets shown. Softimage itself is only called from krakatoa's callbacks and from Finish,
+which send whatever the presenter has ready.
+The crop window is split into tiles and only the tiles that changed since the last image are sent.
+*/
+class ViewerPresenter
+{
+protected:
+	static const int TILE_SIZE = 64;
+	static const int MAX_TILES_PER_CALLBACK = 16; // each one is a NewFragment call on krakatoa's thread, the rest wait for the next callback
+
+	RendererContext& ctx;
+	KrakFragment fragment;           // the whole crop window
+	vector<KrakFragment> tiles;
+	vector<unsigned __int64> tileHashes; // of the pixels last prepared for each tile
+	vector<bool> tileReady;          // the tile holds pixels softimage hasn't been sent yet
+	size_t nextTile;                 // where the next capped delivery starts looking, so the tiles at the end get their turn
+	vector<frame_buffer_pixel_data> shown; // the tiles read from here, the buffers get swapped and refilled under them
+	int shownWidth;                  // size of the last image prepared, 0 before the first one
+	int shownHeight;
+	CRITICAL_SECTION tilesCs;        // the presenter thread fills the tiles, the render side sends them
+
+	vector<frame_buffer_pixel_data> buffers[2];
+	int backBuffer;     // the one the render copies into, the presenter reads the other one
+	int width;
+	int height;
+	bool copying;       // the render is writing the back buffer
+	bool imagePending;  // the back buffer holds an image that hasn't been shown
+	CString title;
+	int progress;
+	bool progressPending;
+	DWORD lastProgress;
+
+	DWORD minInterval; // ms between pushes to softimage
+	HANDLE hThread;
+	CRITICAL_SECTION cs;
+	CONDITION_VARIABLE wake;
+	bool stopping;
+
+	static unsigned __stdcall PresenterThread(void* pParam)
+	{
+		((ViewerPresenter*)pParam)->Present();
+		return 0;
+	}
 
-        const frame_buffer_pixel_data* pKrakPixel;
+	/*
+	The presenter thread only hashes and converts the images into the tiles, softimage is never called from it.
+	The tiles it gets ready go out from Deliver, on the thread krakatoa calls the frame buffer and progress
+	callbacks on, and from Finish on the thread that called render().
+	This only takes part of the viewer work off krakatoa's thread: the SDK can't be called from any other thread,
+	so NewFragment and ProgressUpdate still run in the callbacks (capped at MAX_TILES_PER_CALLBACK tiles each),
+	and PostImage still copies the whole image there since krakatoa reuses its buffer once the callback returns.
+	*/
+	void Present()
+	{
+		DWORD lastPush = GetTickCount() - minInterval;
+		for (;;)
+		{
+			bool stop;
+			{
+				ScopedCriticalSection lock(cs);
+				while (stopping == false && (imagePending == false || copying))
+					SleepConditionVariableCS(&wake, &cs, INFINITE);
+				stop = stopping;
+			}
 
+			// anything that comes in while we wait out the rate limit just replaces what's pending
+			DWORD elapsed = GetTickCount() - lastPush;
+			if (stop == false && elapsed < minInterval)
+				Sleep(minInterval - elapsed);
 
+			bool pushImage;
+			int curWidth = 0;
+			int curHeight = 0;
+			{
+				ScopedCriticalSection lock(cs);
+				// a new copy may have started while we slept, wait for it to land instead of going round again
+				while (imagePending && copying)
+					SleepConditionVariableCS(&wake, &cs, INFINITE);
+				pushImage = imagePending;
+				if (pushImage)
+				{
+					backBuffer = 1 - backBuffer;
+					curWidth  = width;
+					curHeight = height;
+					imagePending = false;
+				}
+			}
 
-        unsigned int kx = 0;
-        for( unsigned int i = 0; i < fragWidth; i++ )
-        {
-            kx = krakXStart + i;
-            
-            pKrakPixel = &this->pLastData[ kx + krakY*krakWidth];
-
-            // do a basic linear to sRGB conversion here...
-            pScanline[i].r = linearToSRGB(pKrakPixel->r);
-            pScanline[i].g = linearToSRGB(pKrakPixel->g);
-            pScanline[i].b = linearToSRGB(pKrakPixel->b);
-            pScanline[i].a = (unsigned char)(((pKrakPixel->r_alpha + pKrakPixel->g_alpha + pKrakPixel->b_alpha) / 3.0f) * 255.0f); // take the average of the alphas for now...
-        }
+			if (pushImage)
+				PrepareTiles(curWidth, curHeight, &buffers[1 - backBuffer][0]);
+			lastPush = GetTickCount();
 
-		return true;
+			if (stop)
+				return; // whatever was pending was prepared above, Finish sends it
+		}
+	}
+
+	// copies out the tiles whose pixels changed since the last image, all of them the first time or if the image size changed.
+	// the pixels are converted when softimage reads the tiles
+	void PrepareTiles(int width, int height, const frame_buffer_pixel_data* pData)
+	{
+		ScopedCriticalSection lock(tilesCs);
+		bool all = width != shownWidth || height != shownHeight;
+		shownWidth  = width;
+		shownHeight = height;
+		shown.resize((size_t)width * height); // only moves when the size changes, and then every tile is updated
+
+		for (size_t i = 0; i < tiles.size(); ++i)
+		{
+			KrakFragment& tile = tiles[i];
+			unsigned __int64 hash = 14695981039346656037ULL;
+			for (unsigned int row = 0; row < tile.GetHeight(); ++row)
+			{
+				const frame_buffer_pixel_data* pRow = pData + (size_t)(tile.GetSourceY() + row) * width + tile.GetSourceX();
+				hash = HashBytes((const char*)pRow, tile.GetWidth() * sizeof(frame_buffer_pixel_data), hash);
+			}
+			if (all == false && hash == tileHashes[i])
+				continue;
+
+			tileHashes[i] = hash;
+			for (unsigned int row = 0; row < tile.GetHeight(); ++row)
+			{
+				size_t start = (size_t)(tile.GetSourceY() + row) * width + tile.GetSourceX();
+				memcpy(&shown[start], pData + start, tile.GetWidth() * sizeof(frame_buffer_pixel_data));
+			}
+			tile.Update(width, height, &shown[0]);
+			tileReady[i] = true;
+		}
+	}
+
+	// sends softimage the tiles that are ready and the latest progress. While rendering it doesn't wait on the presenter
+	// thread, if that's busy with the tiles they go out with the next callback, and so does anything past the first
+	// MAX_TILES_PER_CALLBACK tiles. Flushing sends all of them. Progress is held to the update rate too.
+	void Deliver(bool flush)
+	{
+		if (flush)
+			EnterCriticalSection(&tilesCs);
+		else if (TryEnterCriticalSection(&tilesCs) == FALSE)
+			return;
+		int sent = 0;
+		for (size_t n = 0; n < tiles.size() && (flush || sent < MAX_TILES_PER_CALLBACK); ++n)
+		{
+			size_t i = (nextTile + n) % tiles.size();
+			if (tileReady[i])
+			{
+				tileReady[i] = false;
+				ctx.NewFragment(tiles[i]);
+				sent++;
+				nextTile = i + 1;
+			}
+		}
+		LeaveCriticalSection(&tilesCs);
+
+		bool pushProgress;
+		CString curTitle;
+		int curProgress;
+		{
+			ScopedCriticalSection lock(cs);
+			pushProgress = progressPending && (flush || GetTickCount() - lastProgress >= minInterval);
+			if (pushProgress)
+			{
+				progressPending = false;
+				lastProgress = GetTickCount();
+			}
+			curTitle    = title;
+			curProgress = progress;
+		}
+		if (pushProgress)
+			ctx.ProgressUpdate(curTitle, curTitle, curProgress);
+	}
+
+public:
+	// maxRate is in updates per second, 0 doesn't limit them
+	// imageLeft/imageBottom is where krakatoa's image sits in the frame, non zero when only the crop window is rendered
+	ViewerPresenter(RendererContext& ctx, int cropWidth, int cropHeight, int offsetX, int offsetY, int imageLeft, int imageBottom, double maxRate) :
+		ctx(ctx),
+		fragment(cropWidth, cropHeight, offsetX, offsetY, offsetX - imageLeft, offsetY - imageBottom),
+		nextTile(0),
+		shownWidth(0),
+		shownHeight(0),
+		backBuffer(0),
+		width(0),
+		height(0),
+		copying(false),
+		imagePending(false),
+		progress(0),
+		progressPending(false),
+		lastProgress(0),
+		minInterval(maxRate > 0.0 ? (DWORD)(1000.0 / maxRate) : 0),
+		hThread(0),
+		stopping(false)
+	{
+		for (int y = 0; y < cropHeight; y += TILE_SIZE)
+		{
+			for (int x = 0; x < cropWidth; x += TILE_SIZE)
+				tiles.push_back(KrakFragment(min(TILE_SIZE, cropWidth - x), min(TILE_SIZE, cropHeight - y), offsetX + x, offsetY + y, offsetX - imageLeft + x, offsetY - imageBottom + y));
+		}
+		tileHashes.resize(tiles.size(), 0);
+		tileReady.resize(tiles.size(), false);
+		lastProgress = GetTickCount() - minInterval;
+
+		InitializeCriticalSection(&cs);
+		InitializeCriticalSection(&tilesCs);
+		InitializeConditionVariable(&wake);
+		hThread = (HANDLE)_beginthreadex(0, 0, &PresenterThread, this, 0, 0);
+		if (hThread == 0)
+			Application().LogMessage("Failed to start the viewer update thread, updating the viewer from the render", siWarningMsg);
+	}
+
+	~ViewerPresenter()
+	{
+		Finish();
+		DeleteCriticalSection(&tilesCs);
+		DeleteCriticalSection(&cs);
+	}
+
+	// shows whatever is still pending and stops the presenter, call once the render is done
+	void Finish()
+	{
+		if (hThread == 0)
+			return;
+		{
+			ScopedCriticalSection lock(cs);
+			stopping = true;
+		}
+		WakeAllConditionVariable(&wake);
+		WaitForSingleObject(hThread, INFINITE);
+		CloseHandle(hThread);
+		hThread = 0;
+		Deliver(true);
+	}
+
+	// called on krakatoa's thread, takes a copy of the image for the presenter and sends what it got ready before
+	void PostImage(int width, int height, const frame_buffer_pixel_data* data)
+	{
+		if (hThread == 0)
+		{
+			fragment.Update(width, height, data);
+			ctx.NewFragment(fragment);
+			return;
+		}
+
+		int target;
+		{
+			ScopedCriticalSection lock(cs);
+			copying = true;
+			target  = backBuffer;
+		}
+		vector<frame_buffer_pixel_data>& buffer = buffers[target];
+		buffer.resize((size_t)width * height);
+		if (buffer.empty() == false)
+			memcpy(&buffer[0], data, buffer.size() * sizeof(frame_buffer_pixel_data));
+		{
+			ScopedCriticalSection lock(cs);
+			copying = false;
+			imagePending = buffer.empty() == false;
+			this->width  = width;
+			this->height = height;
+		}
+		WakeAllConditionVariable(&wake);
+		Deliver(false);
+	}
+
+	void PostProgress(const CString& title, int progress)
+	{
+		if (hThread == 0)
+		{
+			ctx.ProgressUpdate(title, title, progress);
+			return;
+		}
+		{
+			ScopedCriticalSection lock(cs);
+			this->title    = title;
+			this->progress = progress;
+			progressPending = true;
+		}
+		Deliver(false);
 	}
 };
 
-class SIFrameBufferInterface : public frame_buffer_interface 
+const int ViewerPresenter::TILE_SIZE;
+const int ViewerPresenter::MAX_TILES_PER_CALLBACK;
+
+class SIProgressLogger : public progress_logger_interface 
 {
-    RendererContext& ctx;
-    KrakFragment* pFrag;
+    ViewerPresenter& presenter;
+    CString curTitle;
 public:
-    SIFrameBufferInterface(RendererContext& ctx, int cropWidth, int cropHeight, int offsetX, int offsetY) : ctx(ctx)
+    SIProgressLogger(ViewerPresenter& presenter) : presenter(presenter)
+    {
+    
+    }
+    virtual ~SIProgressLogger() {}
+	virtual void set_title( const char* title )
+    {
+        curTitle = title;
+        presenter.PostProgress(curTitle, 0);
+    }
+
+	virtual void set_progress( float progress )
     {
-        pFrag = new KrakFragment(cropWidth, cropHeight, offsetX, offsetY);
+        presenter.PostProgress(curTitle, (int)(progress * 100.0f));
+    }
+};
 
+class SIFrameBufferInterface : public frame_buffer_interface 
+{
+    ViewerPresenter& presenter;
+    // preview passes render smaller than the frame, their images get stretched back up to fullWidth x fullHeight
+    int fullWidth;
+    int fullHeight;
+    vector<frame_buffer_pixel_data> upscaled;
+public:
+    SIFrameBufferInterface(ViewerPresenter& presenter) : presenter(presenter), fullWidth(0), fullHeight(0)
+    {
+    }
+    // 0 x 0 passes the images through as they are
+    void SetUpscaleSize(int width, int height)
+    {
+        fullWidth  = width;
+        fullHeight = height;
     }
     virtual ~SIFrameBufferInterface()
     {
-        if (pFrag != 0)
-        {
-            delete pFrag;
-            pFrag = 0;
-        }
     }
 	/*
 	 * Called periodically by the renderer and provides the semi-complete rendered image to the user.
@@ -243,10 +785,23 @@ public:
 	 */
 	virtual void set_frame_buffer( int width, int height, const frame_buffer_pixel_data* data )
     {
-        // assume this is only called from a single thread for now...
-        pFrag->Update(width, height, data);
-        // update softimage
-        ctx.NewFragment(*pFrag);
+        // the presenter takes a copy and updates softimage from its own thread
+        if (fullWidth == 0 || fullHeight == 0 || width <= 0 || height <= 0 || (width == fullWidth && height == fullHeight))
+        {
+            presenter.PostImage(width, height, data);
+            return;
+        }
+
+        // nearest pixel, it's only there until the full resolution pass comes in
+        upscaled.resize((size_t)fullWidth * fullHeight);
+        for (int y = 0; y < fullHeight; ++y)
+        {
+            const frame_buffer_pixel_data* pSrc = data + (size_t)((__int64)y * height / fullHeight) * width;
+            frame_buffer_pixel_data* pDst = &upscaled[(size_t)y * fullWidth];
+            for (int x = 0; x < fullWidth; ++x)
+                pDst[x] = pSrc[(__int64)x * width / fullWidth];
+        }
+        presenter.PostImage(fullWidth, fullHeight, &upscaled[0]);
     }
 };
 
@@ -260,43 +815,1131 @@ public:
     }
 };
 
-class SIPointCloudParticleStream : public particle_stream_interface
+// locked while LockRendererData holds the scene, everything that reads scene data goes through it (see SceneReadGuard)
+static SceneReadGuard g_sceneGuard;
+
+// This class ensures the render data is unlocked safely no matter how the render function exists
+// create on the stack, then when it goes out of scope it cleans up if it needs to 
+class LockRendererData
 {
 protected:
-	static map<string, string> channelNameMappings;
+	Renderer& renderer;
+	bool locked;
+	DWORD lockedAt;
 
-    Geometry& geometry;
-    vector<ICEAttribute> attributes;
-    vector<channel_data> channels;
-    krakatoasr::INT64 particleCount;
-    krakatoasr::INT64 particleIndex;
-    
-    vector<CBaseICEAttributeDataArray*> dataArrays;
-    
 public:
-    SIPointCloudParticleStream(Geometry& geometry) : geometry(geometry), particleCount(-1), particleIndex(0)
-    {
-		if (channelNameMappings.size() == 0) // only happens the first time
+	LockRendererData(Renderer& renderer) :
+		renderer(renderer),
+		locked(false),
+		lockedAt(0)
+	{
+
+	}
+
+	CStatus lock()
+	{
+		if (locked == false)
 		{
-			channelNameMappings["PointPosition"]       = "Position";
-			channelNameMappings["Color"]               = "Color";
-			channelNameMappings["Density"]             = "Density";    // 1 float
-			channelNameMappings["Lighting"]            = "Lighting";   // 3 floats
-			channelNameMappings["MBlurTime"]           = "MBlurTime";  // 1 float
-			channelNameMappings["Absorption"]          = "Absorption"; // 3 floats // only used if absorbtion channel is on
-			channelNameMappings["Emission"]            = "Emission";   // 3 floats // only used if emission is on
-			channelNameMappings["PointNormal"]         = "Normal";     // used by phong shader
-			channelNameMappings["Tangent"]             = "Tangent";    // used by Marschner Hair shader
-			channelNameMappings["PointVelocity"]       = "Velocity";
-			// theses are used by shaders:
-			channelNameMappings["Eccentricity"]        = "Eccentricity";         // used by henyey_greenstein, schlick 
-			channelNameMappings["PhaseEccentricity"]   = "Eccentricity";         // used by henyey_greenstein, schlick  (support both names, assume the user is going to fill one)
-			channelNameMappings["SpecularPower"]       = "SpecularPower";        // used by phong, kajiya_kay shader
-			channelNameMappings["SpecularLevel"]       = "SpecularLevel";        // used by phong, kajiya_kay shader
-			channelNameMappings["DiffuseLevel"]        = "DiffuseLevel";         // used by marschner
-			channelNameMappings["GlintGlossiness"]     = "GlintGlossiness";      // used by marschner
-			channelNameMappings["GlintLevel"]          = "GlintLevel";           // used by marschner
-			channelNameMappings["GlintSize"]           = "GlintSize";            // used by marschner
+			CStatus res = renderer.LockSceneData();
+			if (res == CStatus::OK)
+			{
+				locked = true;
+				g_sceneGuard.Lock();
+				lockedAt = GetTickCount();
+			}
+			return res;
+		}
+		return CStatus::OK;
+	}
+
+	// Softimage can't do anything while the scene is locked, so how long we kept it is logged
+	CStatus unlock()
+	{
+		if (locked)
+		{
+			CStatus res = renderer.UnlockSceneData();
+			if (res == CStatus::OK)
+			{
+				locked = false;
+				g_sceneGuard.Unlock();
+				Application().LogMessage(CString("Scene data was locked for ") + CValue((LONG)(GetTickCount() - lockedAt)).GetAsText() + CString(" ms, ") +
+					CountText(g_sceneGuard.GetReads()) + CString(" reads"), siInfoMsg);
+			}
+			return res;
+		}
+		return CStatus::OK;
+	}
+
+
+	~LockRendererData()
+	{
+		unlock(); // ensure unlocked happens when this object goes out of scope
+	}
+};
+
+
+// bool arrays are bit packed in ICE so we have to go through the array accessor
+void CopyChannelBool(const ChannelCopier& copier, ParticleIndex index, char* pParticle)
+{
+	const CICEAttributeDataArrayBool& dataArray = *(const CICEAttributeDataArrayBool*)copier.pDataArray;
+	pParticle[copier.byteOffset] = dataArray[(ULONG)(copier.sourceStride == 0 ? 0 : index)] ? 1 : 0;
+}
+
+// quaternions are stored as xyzw in krakatoa
+void CopyChannelQuaternion(const ChannelCopier& copier, ParticleIndex index, char* pParticle)
+{
+	const MATH::CQuaternionf& q = *(const MATH::CQuaternionf*)(copier.pSource + index * copier.sourceStride);
+	float* pOut = (float*)(pParticle + copier.byteOffset);
+	pOut[0] = q.GetX();
+	pOut[1] = q.GetY();
+	pOut[2] = q.GetZ();
+	pOut[3] = q.GetW();
+}
+
+void CopyChannelRotation(const ChannelCopier& copier, ParticleIndex index, char* pParticle)
+{
+	const MATH::CRotationf& r = *(const MATH::CRotationf*)(copier.pSource + index * copier.sourceStride);
+	MATH::CQuaternionf q = r.GetQuaternion();
+	float* pOut = (float*)(pParticle + copier.byteOffset);
+	pOut[0] = q.GetX();
+	pOut[1] = q.GetY();
+	pOut[2] = q.GetZ();
+	pOut[3] = q.GetW();
+}
+
+// the byteOffset is filled in once the channel is appended
+template <class TElement>
+ChannelCopier MakeChannelCopier(ChannelCopyFunc copy, ChannelPackFunc pack, int dataSize, CICEAttributeDataArray<TElement>& dataArray)
+{
+	ChannelCopier copier;
+	copier.copy         = copy;
+	copier.pack         = dataArray.IsConstant() ? &PackChannelConstant : pack;
+	copier.pSource      = (const char*)&dataArray[0];
+	copier.sourceStride = dataArray.IsConstant() ? 0 : sizeof(TElement);
+	copier.byteOffset   = 0;
+	copier.dataSize     = dataSize;
+	copier.pDataArray   = &dataArray;
+	return copier;
+}
+
+// everything ScanForChannels learns about one mapped attribute
+struct MappedChannel
+{
+	ChannelCopier copier;
+	string krakatoaName;
+	siICENodeDataType dataType;
+	data_type_t channelType; // how it's stored in the krakatoa particle
+	int arity;
+	bool constant;           // every particle has the same value
+	string attributeName;    // ICE attribute it comes from
+};
+
+// a channel the way it was appended to the stream, so another stream can lay its particles out the same way
+struct AppendedChannel
+{
+	string name;
+	data_type_t type;
+	int arity;
+	int byteOffset;
+};
+
+bool CompareChannelOffset(const MappedChannel& a, const MappedChannel& b)
+{
+	return a.copier.byteOffset < b.copier.byteOffset;
+}
+
+// Where a light is, so culling can hang on to particles that might shadow something the camera sees
+struct LightPlacement
+{
+	bool directional;
+	float x, y, z; // position, or the light's axis for directional lights (either direction along it is treated the same)
+};
+
+/*
+Conservative view volume of the camera used to drop particles krakatoa would never draw.
+The planes face inwards and are in world space, a point is inside when n.p + d >= -margin for all of them.
+The margin leaves room for depth of field, motion blur and filtering.
+When shadow casters are kept, a particle outside the view survives if it sits between a light and the view volume,
+so culling never changes the lighting of what's on screen.
+*/
+class CameraCuller
+{
+protected:
+	float planes[6][4];
+	float margin;
+	bool keepShadowCasters;
+	vector<LightPlacement> lights;
+
+	// takes a plane in camera space (camera looking down -Z) into world space
+	void SetPlane(int plane, const MATH::CMatrix4& camTM, float nx, float ny, float nz, float d)
+	{
+		float axes[3][3];
+		for (int row = 0; row < 3; ++row)
+		{
+			// strip any scaling off the camera
+			float len = 0.0f;
+			for (int col = 0; col < 3; ++col)
+				len += (float)(camTM.GetValue(row, col) * camTM.GetValue(row, col));
+			len = sqrt(len);
+			for (int col = 0; col < 3; ++col)
+				axes[row][col] = len > 0.0f ? (float)camTM.GetValue(row, col) / len : 0.0f;
+		}
+
+		float len = sqrt(nx * nx + ny * ny + nz * nz);
+		float* pPlane = planes[plane];
+		for (int col = 0; col < 3; ++col)
+			pPlane[col] = (nx * axes[0][col] + ny * axes[1][col] + nz * axes[2][col]) / len;
+		pPlane[3] = d / len - (pPlane[0] * (float)camTM.GetValue(3, 0) + pPlane[1] * (float)camTM.GetValue(3, 1) + pPlane[2] * (float)camTM.GetValue(3, 2));
+	}
+
+	// clips the ray o + s*v, s in [sMin, sMax] against the view volume, true if any of it is left
+	bool RayHitsView(const float o[3], const float v[3], float sMin, float sMax) const
+	{
+		for (int i = 0; i < 6; ++i)
+		{
+			const float* pPlane = planes[i];
+			float a = pPlane[0] * o[0] + pPlane[1] * o[1] + pPlane[2] * o[2] + pPlane[3] + margin;
+			float b = pPlane[0] * v[0] + pPlane[1] * v[1] + pPlane[2] * v[2];
+			if (fabs(b) < 1e-12f)
+			{
+				if (a < 0.0f)
+					return false;
+				continue;
+			}
+			float s = -a / b;
+			if (b > 0.0f)
+				sMin = max(sMin, s);
+			else
+				sMax = min(sMax, s);
+			if (sMin > sMax)
+				return false;
+		}
+		return true;
+	}
+
+	// true if the particle could block light on its way to something inside the view volume
+	bool CouldShadowView(float x, float y, float z) const
+	{
+		if (fabs(x) > FLT_MAX || fabs(y) > FLT_MAX || fabs(z) > FLT_MAX || x != x || y != y || z != z)
+			return false; // dead particles with NaN/Inf positions
+
+		const float p[3] = { x, y, z };
+		for (vector<LightPlacement>::const_iterator i = lights.begin(); i != lights.end(); ++i)
+		{
+			if (i->directional)
+			{
+				// somewhere along the light's axis through the particle
+				const float axis[3] = { i->x, i->y, i->z };
+				if (RayHitsView(p, axis, -FLT_MAX, FLT_MAX))
+					return true;
+			}
+			else
+			{
+				// past the particle on the ray from the light through it
+				const float o[3] = { i->x, i->y, i->z };
+				const float v[3] = { x - i->x, y - i->y, z - i->z };
+				if (RayHitsView(o, v, 1.0f, FLT_MAX))
+					return true;
+			}
+		}
+		return false;
+	}
+
+public:
+	CameraCuller() :
+		margin(0.0f),
+		keepShadowCasters(false)
+	{
+		memset(planes, 0, sizeof(planes));
+	}
+
+	// the window is the part of the image that's actually rendered in normalized screen space (-1 to 1),
+	// the whole image or just the crop window for region renders
+	void SetPerspective(const MATH::CMatrix4& camTM, float tanHalfWidth, float tanHalfHeight, float left, float right, float bottom, float top, float nearPlane, float farPlane)
+	{
+		left   *= tanHalfWidth;
+		right  *= tanHalfWidth;
+		bottom *= tanHalfHeight;
+		top    *= tanHalfHeight;
+		SetPlane(0, camTM,  0.0f,  0.0f, -1.0f, -nearPlane);
+		SetPlane(1, camTM,  0.0f,  0.0f,  1.0f, farPlane);
+		SetPlane(2, camTM,  1.0f,  0.0f,  left, 0.0f);
+		SetPlane(3, camTM, -1.0f,  0.0f, -right, 0.0f);
+		SetPlane(4, camTM,  0.0f,  1.0f,  bottom, 0.0f);
+		SetPlane(5, camTM,  0.0f, -1.0f, -top, 0.0f);
+	}
+
+	void SetOrthographic(const MATH::CMatrix4& camTM, float halfWidth, float halfHeight, float left, float right, float bottom, float top, float nearPlane, float farPlane)
+	{
+		SetPlane(0, camTM,  0.0f,  0.0f, -1.0f, -nearPlane);
+		SetPlane(1, camTM,  0.0f,  0.0f,  1.0f, farPlane);
+		SetPlane(2, camTM,  1.0f,  0.0f,  0.0f, -left * halfWidth);
+		SetPlane(3, camTM, -1.0f,  0.0f,  0.0f, right * halfWidth);
+		SetPlane(4, camTM,  0.0f,  1.0f,  0.0f, -bottom * halfHeight);
+		SetPlane(5, camTM,  0.0f, -1.0f,  0.0f, top * halfHeight);
+	}
+
+	void SetMargin(float margin)
+	{
+		this->margin = max(0.0f, margin);
+	}
+
+	// false only if the whole sphere is outside the view volume (and its margin)
+	bool SphereInView(const float center[3], float radius) const
+	{
+		for (int i = 0; i < 6; ++i)
+		{
+			const float* pPlane = planes[i];
+			if (pPlane[0] * center[0] + pPlane[1] * center[1] + pPlane[2] * center[2] + pPlane[3] < -(margin + radius))
+				return false;
+		}
+		return true;
+	}
+
+	void KeepShadowCasters(const vector<LightPlacement>& lights)
+	{
+		this->keepShadowCasters = true;
+		this->lights = lights;
+	}
+
+	// clears the flag of every one of the count positions (stride bytes apart) that can't show up in the render
+	// returns how many were culled
+	krakatoasr::INT64 Cull(const char* pPositions, size_t stride, krakatoasr::INT64 count, unsigned char* pFlags) const
+	{
+		const __m128 zero = _mm_setzero_ps();
+		krakatoasr::INT64 culled = 0;
+		for (krakatoasr::INT64 i = 0; i < count; i += 4)
+		{
+			// gather 4 positions into x, y and z registers, padding the tail with the last one
+			float x[4], y[4], z[4];
+			int lanes = (int)min((krakatoasr::INT64)4, count - i);
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				const float* p = (const float*)(pPositions + (i + min(lane, lanes - 1)) * stride);
+				x[lane] = p[0];
+				y[lane] = p[1];
+				z[lane] = p[2];
+			}
+			__m128 px = _mm_loadu_ps(x);
+			__m128 py = _mm_loadu_ps(y);
+			__m128 pz = _mm_loadu_ps(z);
+
+			// NaN positions fail every compare so they are culled as well
+			__m128 inside = _mm_cmpeq_ps(zero, zero);
+			for (int plane = 0; plane < 6; ++plane)
+			{
+				__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, _mm_set1_ps(planes[plane][0])), _mm_mul_ps(py, _mm_set1_ps(planes[plane][1]))),
+										 _mm_add_ps(_mm_mul_ps(pz, _mm_set1_ps(planes[plane][2])), _mm_set1_ps(planes[plane][3] + margin)));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, zero));
+			}
+
+			int mask = _mm_movemask_ps(inside);
+			if (mask == 0xF)
+				continue;
+			for (int lane = 0; lane < lanes; ++lane)
+			{
+				if ((mask & (1 << lane)) == 0 && pFlags[i + lane] != 0)
+				{
+					if (keepShadowCasters && CouldShadowView(x[lane], y[lane], z[lane]))
+						continue;
+					pFlags[i + lane] = 0;
+					culled++;
+				}
+			}
+		}
+		return culled;
+	}
+};
+
+const unsigned __int64 NO_MERGE_CELL = ~0ULL;
+
+/*
+Grid used to find particles packed closer together than the camera can resolve. Cells are about cellPixels pixels across
+wherever they are, so for perspective cameras they are laid out in screen space and grow with distance (each depth slice
+is about as deep as a cell is wide), for orthographic cameras they are just cubes.
+*/
+class MergeGrid
+{
+protected:
+	float axes[3][3]; // camera axes in world space with the scaling stripped
+	float origin[3];
+	bool perspective;
+	float cellSize;   // tangent of a cell's width for perspective cameras, world size for orthographic ones
+	float logDepthStep;
+	float nearPlane;
+
+	void SetCamera(const MATH::CMatrix4& camTM)
+	{
+		for (int row = 0; row < 3; ++row)
+		{
+			float len = 0.0f;
+			for (int col = 0; col < 3; ++col)
+				len += (float)(camTM.GetValue(row, col) * camTM.GetValue(row, col));
+			len = sqrt(len);
+			for (int col = 0; col < 3; ++col)
+				axes[row][col] = len > 0.0f ? (float)camTM.GetValue(row, col) / len : 0.0f;
+		}
+		for (int col = 0; col < 3; ++col)
+			origin[col] = (float)camTM.GetValue(3, col);
+	}
+
+public:
+	MergeGrid() :
+		perspective(false),
+		cellSize(0.0f),
+		logDepthStep(0.0f),
+		nearPlane(0.0f)
+	{
+		memset(axes, 0, sizeof(axes));
+		memset(origin, 0, sizeof(origin));
+	}
+
+	// tanPixelWidth is the tangent of one pixel's width at the middle of the image
+	void SetPerspective(const MATH::CMatrix4& camTM, float tanPixelWidth, float cellPixels, float nearPlane)
+	{
+		SetCamera(camTM);
+		this->perspective  = true;
+		this->cellSize     = tanPixelWidth * cellPixels;
+		this->logDepthStep = log(1.0f + cellSize);
+		this->nearPlane    = nearPlane;
+	}
+
+	void SetOrthographic(const MATH::CMatrix4& camTM, float pixelWidth, float cellPixels)
+	{
+		SetCamera(camTM);
+		this->perspective = false;
+		this->cellSize    = pixelWidth * cellPixels;
+	}
+
+	// the cell holding the position, or NO_MERGE_CELL where the grid can't say anything (behind the camera, NaN, way off)
+	unsigned __int64 CellKey(const float* pPosition) const
+	{
+		float rel[3] = { pPosition[0] - origin[0], pPosition[1] - origin[1], pPosition[2] - origin[2] };
+		float c[3];
+		for (int k = 0; k < 3; ++k)
+			c[k] = axes[k][0] * rel[0] + axes[k][1] * rel[1] + axes[k][2] * rel[2];
+
+		float u, v, w;
+		if (perspective)
+		{
+			float depth = -c[2]; // looking down -Z
+			if ((depth > nearPlane && depth > 0.0f) == false)
+				return NO_MERGE_CELL;
+			u = c[0] / (depth * cellSize);
+			v = c[1] / (depth * cellSize);
+			w = log(depth) / logDepthStep;
+		}
+		else
+		{
+			u = c[0] / cellSize;
+			v = c[1] / cellSize;
+			w = c[2] / cellSize;
+		}
+
+		// 21 bits per axis
+		const float LIMIT = 1048575.0f;
+		if ((fabs(u) < LIMIT && fabs(v) < LIMIT && fabs(w) < LIMIT) == false)
+			return NO_MERGE_CELL;
+		unsigned __int64 iu = (unsigned __int64)((__int64)floor(u) + 1048576) & 0x1FFFFF;
+		unsigned __int64 iv = (unsigned __int64)((__int64)floor(v) + 1048576) & 0x1FFFFF;
+		unsigned __int64 iw = (unsigned __int64)((__int64)floor(w) + 1048576) & 0x1FFFFF;
+		return iu | (iv << 21) | (iw << 42);
+	}
+};
+
+/*
+Decides which parts of the occlusion meshes can matter: what the camera might see, plus whatever sits in the way of
+the light reaching the particles. The particles are bounded by a sphere, so a point light's shadow volume is the cone
+from the light around that sphere (up to its far side) and a directional light's is the cylinder along the light's axis
+through it. All the tests take bounding spheres and err on the side of keeping things.
+*/
+class OccluderCuller
+{
+protected:
+	const CameraCuller& camera;
+	vector<LightPlacement> lights;
+	bool hasParticles;
+	float center[3];
+	float radius;
+
+public:
+	OccluderCuller(const CameraCuller& camera, const vector<LightPlacement>& lights) :
+		camera(camera),
+		lights(lights),
+		hasParticles(false),
+		radius(0.0f)
+	{
+		memset(center, 0, sizeof(center));
+		for (vector<LightPlacement>::iterator i = this->lights.begin(); i != this->lights.end(); ++i)
+		{
+			if (i->directional)
+			{
+				float len = sqrt(i->x * i->x + i->y * i->y + i->z * i->z);
+				if (len > 0.0f)
+				{
+					i->x /= len;
+					i->y /= len;
+					i->z /= len;
+				}
+			}
+		}
+	}
+
+	void SetParticleBounds(const float boundsMin[3], const float boundsMax[3])
+	{
+		float r2 = 0.0f;
+		for (int k = 0; k < 3; ++k)
+		{
+			center[k] = (boundsMin[k] + boundsMax[k]) * 0.5f;
+			float half = (boundsMax[k] - boundsMin[k]) * 0.5f;
+			r2 += half * half;
+		}
+		radius = sqrt(r2);
+		hasParticles = true;
+	}
+
+	bool SphereMatters(const float c[3], float r) const
+	{
+		if (camera.SphereInView(c, r))
+			return true;
+		if (hasParticles == false)
+			return false;
+
+		for (vector<LightPlacement>::const_iterator i = lights.begin(); i != lights.end(); ++i)
+		{
+			if (i->directional)
+			{
+				// distance from the sphere to the line through the particles along the light
+				float v[3] = { c[0] - center[0], c[1] - center[1], c[2] - center[2] };
+				float along = v[0] * i->x + v[1] * i->y + v[2] * i->z;
+				float dist2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2] - along * along;
+				if (dist2 <= (radius + r) * (radius + r))
+					return true;
+			}
+			else
+			{
+				float axis[3] = { center[0] - i->x, center[1] - i->y, center[2] - i->z };
+				float axisLen = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+				float v[3] = { c[0] - i->x, c[1] - i->y, c[2] - i->z };
+				float vLen = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+				if (vLen - r > axisLen + radius)
+					continue; // past the particles
+				if (axisLen <= radius)
+					return true; // the light is in among the particles, every direction counts
+				float d = (v[0] * axis[0] + v[1] * axis[1] + v[2] * axis[2]) / axisLen;
+				float e = sqrt(max(0.0f, vLen * vLen - d * d));
+				float sinAngle = radius / axisLen;
+				float cosAngle = sqrt(max(0.0f, 1.0f - sinAngle * sinAngle));
+				if (d >= -r && e * cosAngle - d * sinAngle <= r)
+					return true;
+			}
+		}
+		return false;
+	}
+};
+
+// The reject functions clear the flag of particles that can't contribute anything to the render.
+// They only count particles whose flag was still set, so running several over the same flags never counts one twice.
+
+// dead particles ICE didn't delete tend to end up with NaN or infinite positions
+krakatoasr::INT64 RejectNonFinitePositions(const char* pPositions, size_t stride, krakatoasr::INT64 count, unsigned char* pFlags)
+{
+	krakatoasr::INT64 rejected = 0;
+	for (krakatoasr::INT64 i = 0; i < count; ++i, pPositions += stride)
+	{
+		const float* p = (const float*)pPositions;
+		// x - x is only 0 for finite values
+		if (pFlags[i] != 0 && ((p[0] - p[0]) != 0.0f || (p[1] - p[1]) != 0.0f || (p[2] - p[2]) != 0.0f))
+		{
+			pFlags[i] = 0;
+			rejected++;
+		}
+	}
+	return rejected;
+}
+
+// no density means nothing to draw or to block light (NaN densities are dropped too)
+krakatoasr::INT64 RejectEmptyDensity(const char* pDensities, size_t stride, krakatoasr::INT64 count, unsigned char* pFlags)
+{
+	const __m128 zero = _mm_setzero_ps();
+	krakatoasr::INT64 rejected = 0;
+	krakatoasr::INT64 i = 0;
+	if (stride == sizeof(float))
+	{
+		const float* pDensity = (const float*)pDensities;
+		for (; i + 4 <= count; i += 4)
+		{
+			// a lane is set when the density is > 0, NaN fails the compare
+			int mask = _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(pDensity + i), zero));
+			if (mask == 0xF)
+				continue;
+			for (int lane = 0; lane < 4; ++lane)
+			{
+				if ((mask & (1 << lane)) == 0 && pFlags[i + lane] != 0)
+				{
+					pFlags[i + lane] = 0;
+					rejected++;
+				}
+			}
+		}
+	}
+	for (; i < count; ++i)
+	{
+		float density = *(const float*)(pDensities + i * stride);
+		if (pFlags[i] != 0 && (density > 0.0f) == false)
+		{
+			pFlags[i] = 0;
+			rejected++;
+		}
+	}
+	return rejected;
+}
+
+// krakatoa never sees the alpha of a Color4, but ICE setups use alpha 0 to hide particles
+krakatoasr::INT64 RejectTransparentColor(const char* pColors, size_t stride, krakatoasr::INT64 count, unsigned char* pFlags)
+{
+	krakatoasr::INT64 rejected = 0;
+	for (krakatoasr::INT64 i = 0; i < count; ++i, pColors += stride)
+	{
+		float alpha = ((const float*)pColors)[3];
+		if (pFlags[i] != 0 && (alpha > 0.0f) == false)
+		{
+			pFlags[i] = 0;
+			rejected++;
+		}
+	}
+	return rejected;
+}
+
+// bytes of one element of an ICE array (bools are kept one per byte once they are out of ICE)
+size_t GetICEElementSize(siICENodeDataType dataType)
+{
+	switch (dataType)
+	{
+	case siICENodeDataBool:       return 1;
+	case siICENodeDataLong:       return sizeof(LONG);
+	case siICENodeDataFloat:      return sizeof(float);
+	case siICENodeDataVector2:    return sizeof(MATH::CVector2f);
+	case siICENodeDataVector3:    return sizeof(MATH::CVector3f);
+	case siICENodeDataVector4:    return sizeof(MATH::CVector4f);
+	case siICENodeDataQuaternion: return sizeof(MATH::CQuaternionf);
+	case siICENodeDataColor4:     return sizeof(MATH::CColor4f);
+	case siICENodeDataRotation:   return sizeof(MATH::CRotationf);
+	default:                      return 0;
+	}
+}
+
+// one ICE attribute copied out of the scene, the channel's copier reads straight from data
+struct CachedAttribute
+{
+	MappedChannel channel;
+	vector<char> data;
+	unsigned __int64 hash; // of the name and data, only filled in when the entry is going into the cache
+};
+
+struct ParticleCacheEntry
+{
+	vector<CachedAttribute> attributes;
+	vector<string> emptyAttributes; // mapped attributes ICE had no data for
+	krakatoasr::INT64 pointCount;
+	double frame;
+	ULONG renderID;                 // the render that filled the entry, the dirty list is only about changes since then
+	unsigned __int64 hash;
+	size_t bytes;
+	krakatoasr::INT64 lastUse;
+	int users;
+	bool evicted;                   // out of the cache but still read by a stream, deleted when the last one lets go
+};
+
+/*
+Keeps the ICE data of point clouds around between renders so an unchanged cloud doesn't have to be pulled out of ICE again.
+The raw attribute arrays are cached rather than krakatoa particles so culling, channel pruning and the precision
+settings still apply to every render. Entries are handed out to streams and only freed once they are done with them.
+Everything happens on the main thread.
+A cloud is only reused without reading ICE when the render's dirty list can be trusted (region renders and interactive
+previews) and names nothing that could have changed it. Otherwise it's fetched and copied as usual and the hash of the copy
+only decides whether the cached one is kept, which saves no time.
+*/
+class ParticleCache
+{
+protected:
+	map<string, ParticleCacheEntry*> entries;
+	size_t bytes;
+	size_t maxBytes;
+	krakatoasr::INT64 clock;
+
+	void Remove(map<string, ParticleCacheEntry*>::iterator pos)
+	{
+		ParticleCacheEntry* pEntry = pos->second;
+		bytes -= pEntry->bytes;
+		entries.erase(pos);
+		if (pEntry->users == 0)
+			delete pEntry;
+		else
+			pEntry->evicted = true;
+	}
+
+public:
+	ParticleCache() :
+		bytes(0),
+		maxBytes(0),
+		clock(0)
+	{
+	}
+
+	~ParticleCache()
+	{
+		Clear();
+	}
+
+	void SetMaxBytes(size_t maxBytes)
+	{
+		this->maxBytes = maxBytes;
+		Trim();
+	}
+
+	// evicts the least recently used entries until the cache fits
+	void Trim()
+	{
+		while (bytes > maxBytes && entries.empty() == false)
+		{
+			map<string, ParticleCacheEntry*>::iterator oldest = entries.begin();
+			for (map<string, ParticleCacheEntry*>::iterator i = entries.begin(); i != entries.end(); ++i)
+			{
+				if (i->second->lastUse < oldest->second->lastUse)
+					oldest = i;
+			}
+			Application().LogMessage(CString("Evicting cached particles: ") + CString(oldest->first.c_str()), siInfoMsg);
+			Remove(oldest);
+		}
+	}
+
+	void Clear()
+	{
+		while (entries.empty() == false)
+			Remove(entries.begin());
+	}
+
+	// returns 0 if nothing is cached under the key, the entry must be handed back with Release()
+	ParticleCacheEntry* Acquire(const string& key)
+	{
+		map<string, ParticleCacheEntry*>::iterator pos = entries.find(key);
+		if (pos == entries.end())
+			return 0;
+		pos->second->users++;
+		pos->second->lastUse = ++clock;
+		return pos->second;
+	}
+
+	void Release(ParticleCacheEntry* pEntry)
+	{
+		pEntry->users--;
+		if (pEntry->evicted && pEntry->users == 0)
+			delete pEntry;
+	}
+
+	// takes ownership of the entry and hands it back acquired, whatever was cached under the key before is dropped
+	ParticleCacheEntry* Store(const string& key, ParticleCacheEntry* pEntry)
+	{
+		map<string, ParticleCacheEntry*>::iterator pos = entries.find(key);
+		if (pos != entries.end())
+			Remove(pos);
+
+		pEntry->users   = 1;
+		pEntry->evicted = false;
+		pEntry->lastUse = ++clock;
+		entries[key] = pEntry;
+		bytes += pEntry->bytes;
+		Trim();
+		return pEntry;
+	}
+};
+
+static ParticleCache g_particleCache; // lives for the whole session
+
+// settings from the Krakatoa Options property that change how particles are pulled out of ICE
+struct ParticleStreamOptions
+{
+	bool pipelined;                   // pack blocks ahead of krakatoa on worker threads
+	int packThreads;                  // number of packing threads, 0 means one per core (leaving one for krakatoa)
+	const CameraCuller* pCuller;      // drops particles the camera can't see, 0 to keep everything
+	const MergeGrid* pMergeGrid;      // merges particles crowded into the same cell, 0 to leave them alone
+	int mergeMaxPerCell;              // particles a cell can hold before it gets merged
+	bool rejectEmpty;                 // drop particles with no density or NaN/Inf positions
+	bool rejectTransparent;           // drop particles whose Color4 alpha is 0
+	bool emissionEnabled;             // emissive particles still show up with no density
+	bool additiveMode;                // density isn't used to render, particles add their color regardless
+	set<string> unusedChannels;       // krakatoa channels nothing in this render reads, they are never fetched
+	bool halfPrecision;               // store the shading channels as 16 bit floats
+	ParticleCache* pCache;            // keeps ICE data between renders, 0 to always fetch
+	bool snapshot;                    // copy the ICE data so the scene can be unlocked before rendering, always on with a cache
+	bool fetchIDs;                    // level of detail will pick particles by their ICE ID
+	string cacheKey;                  // the cloud's entry in the cache
+	bool cacheTrusted;                // nothing in the dirty list could have changed the cloud
+	double frame;
+	ULONG renderID;
+
+	ParticleStreamOptions() :
+		pipelined(false),
+		packThreads(0),
+		pCuller(0),
+		pMergeGrid(0),
+		mergeMaxPerCell(0),
+		rejectEmpty(false),
+		rejectTransparent(false),
+		emissionEnabled(false),
+		additiveMode(false),
+		halfPrecision(false),
+		pCache(0),
+		snapshot(false),
+		fetchIDs(false),
+		cacheTrusted(false),
+		frame(0.0),
+		renderID(0)
+	{
+	}
+};
+
+int GetWorkerThreadCount(int requested)
+{
+	if (requested > 0)
+		return requested;
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return max(1, (int)info.dwNumberOfProcessors - 1);
+}
+
+typedef void (*ParallelTaskFunc)(void* pParam, int task);
+
+struct ParallelTask
+{
+	ParallelTaskFunc work;
+	void* pParam;
+	int task;
+};
+
+unsigned __stdcall ParallelTaskThread(void* pParam)
+{
+	ParallelTask& task = *(ParallelTask*)pParam;
+	task.work(task.pParam, task.task);
+	return 0;
+}
+
+// runs work(pParam, i) for every i below count on a thread each (the calling thread does the last one) and waits for all of them
+void RunParallelTasks(ParallelTaskFunc work, void* pParam, int count)
+{
+	vector<ParallelTask> tasks(count);
+	vector<HANDLE> threads;
+	for (int i = 0; i < count; ++i)
+	{
+		tasks[i].work   = work;
+		tasks[i].pParam = pParam;
+		tasks[i].task   = i;
+	}
+	for (int i = 0; i + 1 < count; ++i)
+	{
+		HANDLE hThread = (HANDLE)_beginthreadex(0, 0, &ParallelTaskThread, &tasks[i], 0, 0);
+		if (hThread != 0)
+			threads.push_back(hThread);
+		else
+			work(pParam, i); // no thread to spare, do it here
+	}
+	if (count > 0)
+		work(pParam, count - 1);
+	for (vector<HANDLE>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		WaitForSingleObject(*i, INFINITE);
+		CloseHandle(*i);
+	}
+}
+
+// one ICE array copied into a buffer the plugin owns, see SnapshotParticleStreams()
+struct SnapshotCopy
+{
+	const char* pSource;
+	char* pDest;
+	size_t bytes;
+	unsigned __int64* pHash; // hashed as it's copied when not 0
+};
+
+bool CompareSnapshotCopySize(const SnapshotCopy& a, const SnapshotCopy& b)
+{
+	return a.bytes > b.bytes;
+}
+
+struct SnapshotJob
+{
+	vector<SnapshotCopy> copies; // biggest first so the threads finish about together
+	volatile LONG next;
+};
+
+// the threads take copies off the list until it runs out, nothing in here touches the SDK
+void SnapshotTask(void* pParam, int task)
+{
+	SnapshotJob& job = *(SnapshotJob*)pParam;
+	for (LONG i = InterlockedIncrement(&job.next) - 1; i < (LONG)job.copies.size(); i = InterlockedIncrement(&job.next) - 1)
+	{
+		const SnapshotCopy& copy = job.copies[i];
+		memcpy(copy.pDest, copy.pSource, copy.bytes);
+		if (copy.pHash != 0)
+			*copy.pHash = HashBytes(copy.pDest, copy.bytes, *copy.pHash);
+	}
+}
+
+// Anything that can pack its particles one independent block at a time
+class ParticleBlockSource
+{
+public:
+	virtual ~ParticleBlockSource() {}
+	virtual krakatoasr::INT64 GetBlockCount() const = 0;
+	virtual size_t GetBlockBytes() const = 0;
+	// fills pRecords with the block and returns how many particles were packed, must be safe to call from any thread
+	virtual krakatoasr::INT64 PackBlock(krakatoasr::INT64 block, char* pRecords) const = 0;
+};
+
+/*
+Worker threads pack blocks of particles into a ring of staging buffers ahead of the consumer (krakatoa's loading thread).
+Block b always lives in slot b % ringSize, a worker can only claim a block once the consumer has released
+the block that used that slot before it. All the slots share one page aligned arena.
+*/
+class ParticlePackPipeline
+{
+protected:
+	struct Slot
+	{
+		char* pRecords;
+		krakatoasr::INT64 block; // block currently packed into this slot, -1 if none
+		krakatoasr::INT64 count;
+	};
+
+	const ParticleBlockSource& source;
+	vector<Slot> slots;
+	char* pArena;
+	vector<HANDLE> threads;
+
+	CRITICAL_SECTION cs;
+	CONDITION_VARIABLE slotReleased;
+	CONDITION_VARIABLE blockPacked;
+	krakatoasr::INT64 nextBlock;     // next block a worker will claim
+	krakatoasr::INT64 releasedBlock; // every block before this one has been consumed
+	bool stopping;
+
+	static unsigned __stdcall WorkerThread(void* pParam)
+	{
+		((ParticlePackPipeline*)pParam)->Work();
+		return 0;
+	}
+
+	void Work()
+	{
+		const krakatoasr::INT64 blockCount = source.GetBlockCount();
+		const krakatoasr::INT64 ringSize   = (krakatoasr::INT64)slots.size();
+		for (;;)
+		{
+			krakatoasr::INT64 block;
+			{
+				ScopedCriticalSection lock(cs);
+				while (stopping == false && nextBlock < blockCount && nextBlock >= releasedBlock + ringSize)
+					SleepConditionVariableCS(&slotReleased, &cs, INFINITE);
+				if (stopping || nextBlock >= blockCount)
+					return;
+				block = nextBlock++;
+			}
+
+			Slot& slot = slots[(size_t)(block % ringSize)];
+			krakatoasr::INT64 count = source.PackBlock(block, slot.pRecords);
+
+			{
+				ScopedCriticalSection lock(cs);
+				slot.count = count;
+				slot.block = block;
+			}
+			WakeAllConditionVariable(&blockPacked);
+		}
+	}
+
+public:
+	ParticlePackPipeline(const ParticleBlockSource& source, int threadCount) :
+		source(source),
+		pArena(0),
+		nextBlock(0),
+		releasedBlock(0),
+		stopping(false)
+	{
+		InitializeCriticalSection(&cs);
+		InitializeConditionVariable(&slotReleased);
+		InitializeConditionVariable(&blockPacked);
+
+		// a couple of blocks per thread keeps the workers busy while krakatoa drains the current one
+		// block sizes are a multiple of 16 bytes so every slot starts aligned for the pack kernels
+		slots.resize(threadCount * 2);
+		pArena = (char*)VirtualAlloc(0, slots.size() * source.GetBlockBytes(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (pArena == 0)
+		{
+			DeleteCriticalSection(&cs);
+			throw std::runtime_error("Failed to allocate the particle packing buffers");
+		}
+		for (size_t i = 0; i < slots.size(); ++i)
+		{
+			slots[i].pRecords = pArena + i * source.GetBlockBytes();
+			slots[i].block    = -1;
+			slots[i].count    = 0;
+		}
+
+		for (int i = 0; i < threadCount; ++i)
+		{
+			HANDLE hThread = (HANDLE)_beginthreadex(0, 0, &WorkerThread, this, 0, 0);
+			if (hThread != 0)
+				threads.push_back(hThread);
+		}
+		if (threads.empty())
+		{
+			VirtualFree(pArena, 0, MEM_RELEASE);
+			DeleteCriticalSection(&cs);
+			throw std::runtime_error("Failed to start particle packing threads");
+		}
+	}
+
+	~ParticlePackPipeline()
+	{
+		{
+			ScopedCriticalSection lock(cs);
+			stopping = true;
+		}
+		WakeAllConditionVariable(&slotReleased);
+		WakeAllConditionVariable(&blockPacked);
+
+		// one at a time, WaitForMultipleObjects only takes 64 handles and there can be more threads than that
+		for (vector<HANDLE>::iterator i = threads.begin(); i != threads.end(); ++i)
+		{
+			WaitForSingleObject(*i, INFINITE);
+			CloseHandle(*i);
+		}
+
+		VirtualFree(pArena, 0, MEM_RELEASE);
+		DeleteCriticalSection(&cs);
+	}
+
+	// waits for the block to be packed, the records stay valid until ReleaseBlock
+	const char* AcquireBlock(krakatoasr::INT64 block, krakatoasr::INT64& count)
+	{
+		Slot& slot = slots[(size_t)(block % (krakatoasr::INT64)slots.size())];
+
+		ScopedCriticalSection lock(cs);
+		while (slot.block != block)
+			SleepConditionVariableCS(&blockPacked, &cs, INFINITE);
+		count = slot.count;
+		return slot.pRecords;
+	}
+
+	void ReleaseBlock(krakatoasr::INT64 block)
+	{
+		{
+			ScopedCriticalSection lock(cs);
+			releasedBlock = block + 1;
+		}
+		WakeAllConditionVariable(&slotReleased);
+	}
+};
+
+class SIPointCloudParticleStream : public particle_stream_interface, public ParticleBlockSource
+{
+protected:
+	static map<string, string> channelNameMappings;
+
+    Geometry geometry; // a copy, only read while scanning and let go in FinishSnapshot while the scene is still locked
+    ParticleStreamOptions options;
+    vector<ChannelCopier> copiers;
+    vector<MappedChannel> scanned; // everything found in ICE, trimmed down before AppendChannels()
+    vector<string> channelNames; // krakatoa channel name for each copier
+    vector<siICENodeDataType> channelTypes; // ICE type feeding each copier
+    vector<data_type_t> channelStorage; // how each copier's channel is stored in the krakatoa particle
+    vector<AppendedChannel> appendedChannels; // in the order they were appended, for the preview's pass streams
+    krakatoasr::INT64 pointCount;    // points in the cloud
+    krakatoasr::INT64 particleCount; // particles krakatoa will get, less than pointCount if some were culled
+    krakatoasr::INT64 particleIndex;
+
+    // one bit per point, set for the ones handed to krakatoa, empty when all of them are
+    vector<unsigned int> keepMask;
+    vector<unsigned int> fullMask;       // keepMask from SelectParticles while a subset is being handed out
+    krakatoasr::INT64 fullParticleCount;
+    bool subsetActive;
+
+    // particles made by merging crowded cells, whole krakatoa records handed out after the ICE points
+    vector<char> mergedRecords;
+    krakatoasr::INT64 mergedCount;
+    vector<krakatoasr::INT64> mergedPicks; // the merged records in the current subset, empty for all of them
+    krakatoasr::INT64 mergedOut;           // merged records krakatoa gets, included in particleCount
+    krakatoasr::INT64 mergedIndex;
+    
+    vector<CBaseICEAttributeDataArray*> dataArrays;
+
+    // with the pipeline, particles are packed a block at a time into interleaved records and get_next_particle just hands them out,
+    // without it they are copied straight out of the ICE arrays into krakatoa's particle
+    static const krakatoasr::INT64 PACK_BLOCK_SIZE = 4096;
+    size_t recordSize;   // bytes of the krakatoa particle we fill in
+    size_t recordStride; // padded record size in the pipeline's buffers (see the pack kernels)
+    krakatoasr::INT64 pointIndex; // next ICE point for the direct copy
+    krakatoasr::INT64 stagedBlock;
+    krakatoasr::INT64 stagedCount;
+    krakatoasr::INT64 stagedCursor;
+    const char* pStaged;
+
+    // only created once krakatoa starts pulling particles, when options.pipelined is set
+    ParticlePackPipeline* pPipeline;
+
+    // with options.snapshot the copiers read the plugin's own copy of the ICE data, so the scene can be unlocked early
+    CString cloudName;               // for the log, the geometry isn't asked once the scanning is done
+    ParticleCacheEntry* pCacheEntry; // the copy the copiers read, shared with the cache when there is one
+    ParticleCacheEntry* pSnapshot;   // set up by ScanForChannels, filled in by SnapshotParticleStreams(), 0 without options.snapshot
+    CICEAttributeDataArrayLong* pIDArray; // only fetched when level of detail can pick particles by ID
+    vector<LONG> ids;                     // copy of the IDs
+    
+public:
+    SIPointCloudParticleStream(Geometry& geometry, const ParticleStreamOptions& options) : 
+        geometry(geometry), 
+        options(options),
+        pointCount(0),
+        particleCount(-1), 
+        particleIndex(0),
+        fullParticleCount(0),
+        subsetActive(false),
+        mergedCount(0),
+        mergedOut(0),
+        mergedIndex(0),
+        recordSize(0),
+        pointIndex(0),
+        recordStride(0),
+        stagedBlock(-1),
+        stagedCount(0),
+        stagedCursor(0),
+        pStaged(0),
+        pPipeline(0),
+        pCacheEntry(0),
+        pSnapshot(0),
+        pIDArray(0)
+    {
+		if (channelNameMappings.size() == 0) // only happens the first time
+		{
+			channelNameMappings["PointPosition"]       = "Position";
+			channelNameMappings["Color"]               = "Color";
+			channelNameMappings["Density"]             = "Density";    // 1 float
+			channelNameMappings["Lighting"]            = "Lighting";   // 3 floats
+			channelNameMappings["MBlurTime"]           = "MBlurTime";  // 1 float
+			channelNameMappings["Absorption"]          = "Absorption"; // 3 floats // only used if absorbtion channel is on
+			channelNameMappings["Emission"]            = "Emission";   // 3 floats // only used if emission is on
+			channelNameMappings["PointNormal"]         = "Normal";     // used by phong shader
+			channelNameMappings["Tangent"]             = "Tangent";    // used by Marschner Hair shader
+			channelNameMappings["PointVelocity"]       = "Velocity";
+			// theses are used by shaders:
+			channelNameMappings["Eccentricity"]        = "Eccentricity";         // used by henyey_greenstein, schlick 
+			channelNameMappings["PhaseEccentricity"]   = "Eccentricity";         // used by henyey_greenstein, schlick  (support both names, assume the user is going to fill one)
+			channelNameMappings["SpecularPower"]       = "SpecularPower";        // used by phong, kajiya_kay shader
+			channelNameMappings["SpecularLevel"]       = "SpecularLevel";        // used by phong, kajiya_kay shader
+			channelNameMappings["DiffuseLevel"]        = "DiffuseLevel";         // used by marschner
+			channelNameMappings["GlintGlossiness"]     = "GlintGlossiness";      // used by marschner
+			channelNameMappings["GlintLevel"]          = "GlintLevel";           // used by marschner
+			channelNameMappings["GlintSize"]           = "GlintSize";            // used by marschner
 			channelNameMappings["Specular2Glossiness"] = "Specular2Glossiness";  // used by marschner
 			channelNameMappings["Specular2Level"]      = "Specular2Level";       // used by marschner
 			channelNameMappings["Specular2Shift"]      = "Specular2Shift";       // used by marschner
@@ -320,182 +1963,1304 @@ public:
 			*/
 		}
         
+        cloudName = geometry.GetName();
         ScanForChannels();
+        FetchIDs();
     } 
     virtual ~SIPointCloudParticleStream() 
     {
-        for (vector<CBaseICEAttributeDataArray*>::iterator i=dataArrays.begin(); i != dataArrays.end(); i++)
+        StopPipeline(); // workers read from the data arrays so they have to go first
+
+        if (pCacheEntry != 0)
+        {
+            if (options.pCache != 0)
+                options.pCache->Release(pCacheEntry);
+            else
+                delete pCacheEntry;
+            pCacheEntry = 0;
+        }
+        delete pSnapshot; // only still here if the snapshot was never taken
+
+        for (vector<CBaseICEAttributeDataArray*>::iterator i=dataArrays.begin(); i != dataArrays.end(); i++)
+        {
+            CBaseICEAttributeDataArray*& ptr = *i;
+            if (ptr != 0)
+            {
+                delete ptr;
+                ptr = 0;
+            }
+        }
+    }
+
+    // the data array is owned by the stream, returns 0 if ICE didn't give us any data
+    template <class TArray>
+    TArray* FetchDataArray(ICEAttribute& attr)
+    {
+        g_sceneGuard.NoteRead("ICE attribute data");
+        TArray* pArray = new TArray();
+        dataArrays.push_back(pArray);
+        attr.GetDataArray(*pArray);
+        return pArray->GetCount() > 0 ? pArray : 0;
+    }
+
+    /*
+    Finds the ICE attributes krakatoa knows about and fetches their data. Nothing is appended to the
+    particle layout yet, that waits for AppendChannels() so channels can still be dropped in between.
+    */
+    void ScanForChannels()
+    {
+        g_sceneGuard.NoteRead("ICE attributes");
+        CStatus res;
+        CPointRefArray points( geometry.GetPoints() );
+        pointCount    = points.GetCount();
+        particleCount = pointCount;
+
+        scanned.clear();
+        copiers.clear();
+        channelNames.clear();
+        channelTypes.clear();
+        keepMask.clear();
+
+		if (particleCount == 0) // don't scan for anything if the point cloud is empty
+		{
+			Application().LogMessage(CString("Point cloud is empty skipping channel mapping: ") + cloudName , siInfoMsg);
+			return;
+		}
+		
+        
+        // clouds that haven't changed since the last render come straight out of the cache
+        if (options.pCache != 0 && options.cacheTrusted && ScanCachedChannels())
+            return;
+
+        vector<string> emptyAttributes;
+        CRefArray attributesRefArray = geometry.GetICEAttributes();
+        for (int i=0; i < attributesRefArray.GetCount(); i++)
+        {
+            ICEAttribute attr(attributesRefArray[i]);
+            string attrName  = attr.GetName().GetAsciiString();
+
+            string krakName;
+            if (GetKrakatoaChannel(attr, krakName) == false)
+                continue;
+
+            if (options.unusedChannels.count(krakName) != 0)
+            {
+                Application().LogMessage(CString("Skipping channel nothing in this render uses: ") + CString(attr.GetName()), siInfoMsg);
+                continue;
+            }
+
+            MappedChannel channel;
+            channel.attributeName = attrName;
+            channel.krakatoaName  = krakName;
+            channel.dataType     = attr.GetDataType();
+            channel.channelType  = DATA_TYPE_FLOAT32;
+            channel.constant     = attr.IsConstant();
+            ChannelCopier& copier = channel.copier;
+            copier.pDataArray = 0; // stays 0 if ICE has no data for the attribute
+
+            // resolve the type once here, get_next_particle only runs the copier
+            switch (channel.dataType)
+            {
+            case siICENodeDataBool:
+            {
+                CICEAttributeDataArrayBool* pArray = FetchDataArray<CICEAttributeDataArrayBool>(attr);
+                if (pArray == 0)
+                    break;
+                channel.channelType = DATA_TYPE_UINT8;
+                channel.arity       = 1;
+                copier.copy         = &CopyChannelBool;
+                copier.pack         = &PackChannelGeneric;
+                copier.pSource      = 0;
+                copier.sourceStride = pArray->IsConstant() ? 0 : 1;
+                copier.byteOffset   = 0;
+                copier.dataSize     = 1;
+                copier.pDataArray   = pArray;
+                break;
+            }
+            case siICENodeDataLong:
+            {
+                CICEAttributeDataArrayLong* pArray = FetchDataArray<CICEAttributeDataArrayLong>(attr);
+                if (pArray == 0)
+                    break;
+                channel.channelType = DATA_TYPE_INT32;
+                channel.arity       = 1;
+                copier = MakeChannelCopier(&CopyChannelDirect<LONG, 1>, &PackChannelGeneric, sizeof(LONG), *pArray);
+                break;
+            }
+            case siICENodeDataFloat:
+            {
+                CICEAttributeDataArrayFloat* pArray = FetchDataArray<CICEAttributeDataArrayFloat>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 1;
+                copier = MakeChannelCopier(&CopyChannelDirect<float, 1>, &PackChannelFloat1, sizeof(float), *pArray);
+                break;
+            }
+            case siICENodeDataVector2:
+            {
+                CICEAttributeDataArrayVector2f* pArray = FetchDataArray<CICEAttributeDataArrayVector2f>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 2;
+                copier = MakeChannelCopier(&CopyChannelDirect<float, 2>, &PackChannelGeneric, 2 * sizeof(float), *pArray);
+                break;
+            }
+            case siICENodeDataVector3:
+            {
+                CICEAttributeDataArrayVector3f* pArray = FetchDataArray<CICEAttributeDataArrayVector3f>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 3;
+                copier = MakeChannelCopier(&CopyChannelDirect<float, 3>, &PackChannelFloatN<3>, 3 * sizeof(float), *pArray);
+                break;
+            }
+            case siICENodeDataVector4:
+            {
+                CICEAttributeDataArrayVector4f* pArray = FetchDataArray<CICEAttributeDataArrayVector4f>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 4;
+                copier = MakeChannelCopier(&CopyChannelDirect<float, 4>, &PackChannelFloatN<4>, 4 * sizeof(float), *pArray);
+                break;
+            }
+            case siICENodeDataQuaternion:
+            {
+                CICEAttributeDataArrayQuaternionf* pArray = FetchDataArray<CICEAttributeDataArrayQuaternionf>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 4;
+                copier = MakeChannelCopier(&CopyChannelQuaternion, &PackChannelGeneric, 4 * sizeof(float), *pArray);
+                break;
+            }
+            case siICENodeDataColor4:
+            {
+                CICEAttributeDataArrayColor4f* pArray = FetchDataArray<CICEAttributeDataArrayColor4f>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 3; // NOTE: krakatoa expected color to be just RGB, not alpha, this is a special case mis-map on purpose
+                copier = MakeChannelCopier(&CopyChannelDirect<float, 3>, &PackChannelFloatN<3>, 3 * sizeof(float), *pArray);
+                break;
+            }
+            case siICENodeDataRotation:
+            {
+                CICEAttributeDataArrayRotationf* pArray = FetchDataArray<CICEAttributeDataArrayRotationf>(attr);
+                if (pArray == 0)
+                    break;
+                channel.arity = 4; // store as quat xyzw
+                copier = MakeChannelCopier(&CopyChannelRotation, &PackChannelGeneric, 4 * sizeof(float), *pArray);
+                break;
+            }
+            default:
+                continue; // skip this channel if its not a supported data type
+                    
+            }
+
+            if (copier.pDataArray == 0)
+            {
+                emptyAttributes.push_back(attrName);
+                continue;
+            }
+            scanned.push_back(channel);
+        }
+
+        if (options.snapshot)
+            PrepareSnapshot(emptyAttributes);
+    }
+
+    // the krakatoa channel an ICE attribute feeds, false if it isn't one we know how to load
+    bool GetKrakatoaChannel(ICEAttribute& attr, string& krakatoaName) const
+    {
+        if (attr.IsDefined() == false || attr.GetContextType() != siICENodeContextComponent0D)
+            return false;
+
+        // see if we have a mapping into krakatoa for this
+        map<string,string>::const_iterator pos = channelNameMappings.find(attr.GetName().GetAsciiString());
+        if (channelNameMappings.end() == pos)
+            return false; // channel is not supported by krakatoa so skip it
+
+        krakatoaName = pos->second;
+        return true;
+    }
+
+    // fills in the scanned channels from the cache, false if the cloud isn't cached or ICE now has other attributes
+    bool ScanCachedChannels()
+    {
+        ParticleCacheEntry* pEntry = options.pCache->Acquire(options.cacheKey);
+        if (pEntry == 0)
+            return false;
+
+        bool valid = pEntry->pointCount == pointCount && pEntry->frame == options.frame && pEntry->renderID == options.renderID;
+        CRefArray attributesRefArray = geometry.GetICEAttributes();
+        for (int i=0; valid && i < attributesRefArray.GetCount(); i++)
+        {
+            ICEAttribute attr(attributesRefArray[i]);
+            string attrName = attr.GetName().GetAsciiString();
+            string krakName;
+            if (GetKrakatoaChannel(attr, krakName) == false || options.unusedChannels.count(krakName) != 0)
+                continue;
+            if (find(pEntry->emptyAttributes.begin(), pEntry->emptyAttributes.end(), attrName) != pEntry->emptyAttributes.end())
+                continue;
+
+            const CachedAttribute* pCached = 0;
+            for (vector<CachedAttribute>::const_iterator j = pEntry->attributes.begin(); j != pEntry->attributes.end(); ++j)
+            {
+                if (j->channel.attributeName == attrName && j->channel.dataType == attr.GetDataType())
+                    pCached = &*j;
+            }
+            if (pCached == 0)
+                valid = false; // cached before this render needed it
+            else
+                scanned.push_back(pCached->channel);
+        }
+
+        if (valid == false)
+        {
+            scanned.clear();
+            options.pCache->Release(pEntry);
+            return false;
+        }
+
+        pCacheEntry = pEntry;
+        Application().LogMessage(CString("Using cached particle data: ") + cloudName, siInfoMsg);
+        return true;
+    }
+
+    // level of detail picks particles by ID when the cloud has them, they're fetched along with the channels
+    void FetchIDs()
+    {
+        if (options.fetchIDs == false || pointCount == 0)
+            return;
+        ICEAttribute attr = geometry.GetICEAttributeFromName(L"ID");
+        if (attr.IsValid() == false || attr.GetDataType() != siICENodeDataLong || attr.IsConstant())
+            return;
+        pIDArray = FetchDataArray<CICEAttributeDataArrayLong>(attr);
+        if (pIDArray != 0 && pIDArray->GetCount() < (ULONG)pointCount)
+            pIDArray = 0; // stays in dataArrays to be deleted
+    }
+
+    /*
+    Sets up the plugin's copy of what was just fetched, the copying itself is left to SnapshotParticleStreams()
+    so the big arrays of every cloud can be copied at the same time. Bools are unpacked here since
+    ICE's packed bits are only read through the SDK's accessor.
+    */
+    void PrepareSnapshot(const vector<string>& emptyAttributes)
+    {
+        ParticleCacheEntry* pEntry = new ParticleCacheEntry();
+        pEntry->emptyAttributes = emptyAttributes;
+        pEntry->pointCount      = pointCount;
+        pEntry->frame           = options.frame;
+        pEntry->renderID        = options.renderID;
+        pEntry->hash            = 14695981039346656037ULL;
+        pEntry->bytes           = 0;
+        pEntry->lastUse         = 0;
+        pEntry->users           = 0;
+        pEntry->evicted         = false;
+
+        pEntry->attributes.resize(scanned.size());
+        for (size_t i = 0; i < scanned.size(); ++i)
+        {
+            CachedAttribute& cached = pEntry->attributes[i];
+            cached.channel = scanned[i];
+            cached.hash    = HashBytes(cached.channel.attributeName.c_str(), cached.channel.attributeName.size(), 14695981039346656037ULL);
+            ChannelCopier& copier = cached.channel.copier;
+
+            krakatoasr::INT64 count = copier.sourceStride == 0 ? 1 : pointCount;
+            cached.data.resize((size_t)count * GetICEElementSize(cached.channel.dataType));
+            if (cached.channel.dataType == siICENodeDataBool)
+            {
+                // out of ICE's packed bits into a byte each
+                const CICEAttributeDataArrayBool& bools = *(const CICEAttributeDataArrayBool*)copier.pDataArray;
+                for (krakatoasr::INT64 j = 0; j < count; ++j)
+                    cached.data[(size_t)j] = bools[(ULONG)j] ? 1 : 0;
+                copier.copy = &CopyChannelDirect<unsigned char, 1>;
+                if (options.pCache != 0)
+                    cached.hash = HashBytes(&cached.data[0], cached.data.size(), cached.hash);
+            }
+            pEntry->bytes += cached.data.size();
+        }
+        pSnapshot = pEntry;
+    }
+
+    // the copies that fill in the snapshot, they only read the fetched arrays so they can be made on any thread
+    void GetSnapshotCopies(vector<SnapshotCopy>& copies)
+    {
+        if (pSnapshot != 0)
+        {
+            for (vector<CachedAttribute>::iterator i = pSnapshot->attributes.begin(); i != pSnapshot->attributes.end(); ++i)
+            {
+                if (i->channel.dataType == siICENodeDataBool || i->data.empty())
+                    continue;
+                SnapshotCopy copy;
+                copy.pSource = i->channel.copier.pSource;
+                copy.pDest   = &i->data[0];
+                copy.bytes   = i->data.size();
+                copy.pHash   = options.pCache != 0 ? &i->hash : 0;
+                copies.push_back(copy);
+            }
+        }
+        if (pIDArray != 0)
+        {
+            ids.resize((size_t)pointCount);
+            SnapshotCopy copy;
+            copy.pSource = (const char*)&(*pIDArray)[0];
+            copy.pDest   = (char*)&ids[0];
+            copy.bytes   = ids.size() * sizeof(LONG);
+            copy.pHash   = 0;
+            copies.push_back(copy);
+        }
+    }
+
+    /*
+    Once the copies are made the channels read from them and the ICE arrays are let go. With a cache the snapshot goes into it,
+    unless the cache already holds the same data for the cloud in which case that copy is kept instead.
+    Without options.snapshot the channels keep reading ICE's arrays, which are only let go when the stream is deleted.
+    Either way the geometry isn't needed anymore, it goes now while the scene is locked rather than after the render.
+    */
+    void FinishSnapshot()
+    {
+        geometry = Geometry();
+        pIDArray = 0; // the IDs were copied with the snapshot copies
+        if (pSnapshot != 0)
+        {
+            ParticleCacheEntry* pEntry = pSnapshot;
+            pSnapshot = 0;
+            for (vector<CachedAttribute>::iterator i = pEntry->attributes.begin(); i != pEntry->attributes.end(); ++i)
+            {
+                ChannelCopier& copier = i->channel.copier;
+                copier.pDataArray = 0;
+                copier.pSource    = &i->data[0];
+                pEntry->hash = HashBytes((const char*)&i->hash, sizeof(i->hash), pEntry->hash);
+            }
+
+            if (options.pCache != 0)
+            {
+                ParticleCacheEntry* pOld = options.pCache->Acquire(options.cacheKey);
+                if (pOld != 0 && pOld->hash == pEntry->hash && pOld->pointCount == pEntry->pointCount && pOld->bytes == pEntry->bytes && pOld->emptyAttributes == pEntry->emptyAttributes)
+                {
+                    // same data as last time, the dirty list was just being careful
+                    delete pEntry;
+                    pEntry = pOld;
+                    pEntry->frame    = options.frame;
+                    pEntry->renderID = options.renderID;
+                    Application().LogMessage(CString("ICE data unchanged since the last render, keeping the cached copy: ") + cloudName, siInfoMsg);
+                }
+                else
+                {
+                    if (pOld != 0)
+                        options.pCache->Release(pOld);
+                    pEntry = options.pCache->Store(options.cacheKey, pEntry);
+                }
+            }
+
+            for (size_t i = 0; i < scanned.size(); ++i)
+                scanned[i] = pEntry->attributes[i].channel;
+            pCacheEntry = pEntry;
+        }
+
+        // everything reads from the snapshot now
+        if (options.snapshot)
+        {
+            for (vector<CBaseICEAttributeDataArray*>::iterator i = dataArrays.begin(); i != dataArrays.end(); ++i)
+                delete *i;
+            dataArrays.clear();
+        }
+    }
+
+    /*
+    The value shared by every particle of a float, Vector3f or Color4f channel (arity floats are written to pValue).
+    Returns false if the channel isn't there or varies from particle to particle.
+    */
+    bool GetConstantChannel(const char* krakatoaName, siICENodeDataType dataType, float* pValue) const
+    {
+        for (vector<MappedChannel>::const_iterator i = scanned.begin(); i != scanned.end(); ++i)
+        {
+            if (i->krakatoaName == krakatoaName && i->dataType == dataType)
+            {
+                if (i->constant == false || i->copier.pSource == 0)
+                    return false;
+                memcpy(pValue, i->copier.pSource, i->arity * sizeof(float));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // forgets a scanned channel so it's never appended, only works before AppendChannels()
+    void DropChannel(const char* krakatoaName, const char* reason)
+    {
+        for (vector<MappedChannel>::iterator i = scanned.begin(); i != scanned.end(); ++i)
+        {
+            if (i->krakatoaName == krakatoaName)
+            {
+                Application().LogMessage(CString("Dropping channel ") + CString(krakatoaName) + CString(" (") + CString(reason) + CString("): ") + cloudName, siInfoMsg);
+                scanned.erase(i);
+                return;
+            }
+        }
+    }
+
+    // constant channels holding the value krakatoa assumes when the channel is missing don't need to be copied at all
+    void DropDefaultChannels()
+    {
+        float value[3];
+        if (GetConstantChannel("Density", siICENodeDataFloat, value) && value[0] == 1.0f)
+            DropChannel("Density", "constant 1");
+        if (GetConstantChannel("Velocity", siICENodeDataVector3, value) && value[0] == 0.0f && value[1] == 0.0f && value[2] == 0.0f)
+            DropChannel("Velocity", "constant 0");
+        if ((GetConstantChannel("Emission", siICENodeDataVector3, value) || GetConstantChannel("Emission", siICENodeDataColor4, value)) && value[0] == 0.0f && value[1] == 0.0f && value[2] == 0.0f)
+            DropChannel("Emission", "constant 0");
+    }
+
+    // channels that only feed shading, where a half's 3 digits are plenty
+    // (Position, Velocity, Density and MBlurTime need the range or precision of a float)
+    static bool IsHalfPrecisionChannel(const MappedChannel& channel)
+    {
+        if (channel.channelType != DATA_TYPE_FLOAT32 || channel.arity > 4 ||
+            (channel.dataType != siICENodeDataFloat && channel.dataType != siICENodeDataVector3 && channel.dataType != siICENodeDataVector4 && channel.dataType != siICENodeDataColor4))
+            return false;
+        const string& name = channel.krakatoaName;
+        return name != "Position" && name != "Velocity" && name != "Density" && name != "MBlurTime";
+    }
+
+    // switches a float channel over to being stored as halves
+    static void UseHalfPrecision(MappedChannel& channel)
+    {
+        ChannelCopier& copier = channel.copier;
+        channel.channelType = DATA_TYPE_FLOAT16;
+        copier.dataSize     = channel.arity * sizeof(unsigned short);
+        switch (channel.arity)
+        {
+        case 1: copier.copy = &CopyChannelHalf<1>; copier.pack = &PackChannelHalf1;    break;
+        case 2: copier.copy = &CopyChannelHalf<2>; copier.pack = &PackChannelHalfN<2>; break;
+        case 3: copier.copy = &CopyChannelHalf<3>; copier.pack = &PackChannelHalfN<3>; break;
+        case 4: copier.copy = &CopyChannelHalf<4>; copier.pack = &PackChannelHalfN<4>; break;
+        }
+    }
+
+    // merged particles carry their combined density in the Density channel, so clouds without one get a constant 1
+    bool WillMerge() const
+    {
+        return options.pMergeGrid != 0 && options.mergeMaxPerCell > 0 && pointCount > options.mergeMaxPerCell;
+    }
+
+    // lays out the krakatoa particle from whatever channels are left, has to happen before the stream is used
+    void AppendChannels()
+    {
+        vector<MappedChannel> mapped(scanned);
+        bool hasDensity = false;
+        for (vector<MappedChannel>::iterator i = mapped.begin(); i != mapped.end(); ++i)
+            hasDensity = hasDensity || (i->krakatoaName == "Density" && i->dataType == siICENodeDataFloat);
+        if (WillMerge() && hasDensity == false)
         {
-            CBaseICEAttributeDataArray*& ptr = *i;
-            if (ptr != 0)
+            static const float unitDensity = 1.0f;
+            MappedChannel density;
+            density.krakatoaName        = "Density";
+            density.dataType            = siICENodeDataFloat;
+            density.channelType         = DATA_TYPE_FLOAT32;
+            density.arity               = 1;
+            density.constant            = true;
+            density.copier.copy         = &CopyChannelDirect<float, 1>;
+            density.copier.pack         = &PackChannelConstant;
+            density.copier.pSource      = (const char*)&unitDensity;
+            density.copier.sourceStride = 0;
+            density.copier.byteOffset   = 0;
+            density.copier.dataSize     = sizeof(float);
+            density.copier.pDataArray   = 0;
+            mapped.push_back(density);
+        }
+
+        for (vector<MappedChannel>::iterator i = mapped.begin(); i != mapped.end(); ++i)
+        {
+            if (options.halfPrecision && IsHalfPrecisionChannel(*i))
+                UseHalfPrecision(*i); // the half kernels cope with constant arrays as well
+            channel_data data = this->append_channel(i->krakatoaName.c_str(), i->channelType, i->arity);
+            i->copier.byteOffset = data.byteOffset;
+            AppendedChannel appended;
+            appended.name       = i->krakatoaName;
+            appended.type       = i->channelType;
+            appended.arity      = i->arity;
+            appended.byteOffset = data.byteOffset;
+            appendedChannels.push_back(appended);
+            Application().LogMessage(CString("Mapping channel: ") + CString(i->attributeName.c_str()) + CString(" ") +  CString(i->krakatoaName.c_str()) ,siInfoMsg);
+        }
+
+        // the pack kernels need the channels in record order
+        sort(mapped.begin(), mapped.end(), CompareChannelOffset);
+        for (vector<MappedChannel>::iterator i = mapped.begin(); i != mapped.end(); ++i)
+        {
+            copiers.push_back(i->copier);
+            channelNames.push_back(i->krakatoaName);
+            channelTypes.push_back(i->dataType);
+            channelStorage.push_back(i->channelType);
+        }
+
+        recordSize = 0;
+        for (vector<ChannelCopier>::const_iterator i = copiers.begin(); i != copiers.end(); ++i)
+            recordSize = max(recordSize, (size_t)(i->byteOffset + i->dataSize));
+        recordStride = (recordSize + 4 + 15) & ~(size_t)15;
+    }
+
+    // index of the copier feeding a krakatoa channel from the given ICE type, or -1
+    int FindChannel(const char* krakatoaName, siICENodeDataType dataType) const
+    {
+        for (size_t i = 0; i < channelNames.size(); ++i)
+        {
+            if (channelNames[i] == krakatoaName && channelTypes[i] == dataType)
+                return (int)i;
+        }
+        return -1;
+    }
+
+    bool IsKept(krakatoasr::INT64 point) const
+    {
+        return keepMask.empty() || (keepMask[(size_t)(point >> 5)] & (1u << (point & 31))) != 0;
+    }
+
+    // the points the keep mask lets through, the bits past pointCount in the last word don't count
+    krakatoasr::INT64 CountKept() const
+    {
+        if (keepMask.empty())
+            return pointCount;
+        krakatoasr::INT64 kept = 0;
+        for (size_t w = 0; w < keepMask.size(); ++w)
+        {
+            unsigned int bits = keepMask[w];
+            krakatoasr::INT64 first = (krakatoasr::INT64)w * 32;
+            if (pointCount - first < 32)
+                bits &= (1u << (pointCount - first)) - 1;
+            bits = bits - ((bits >> 1) & 0x55555555);
+            bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+            kept += (((bits + (bits >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+        }
+        return kept;
+    }
+
+    // particle_count() has to match what get_next_particle hands out or krakatoa reads past the end of the stream,
+    // so after every pass that drops particles the count is checked against the mask. If it's off that pass has a bug,
+    // and rendering whatever the mask says would only hide it
+    void CheckParticleCount(const char* pass)
+    {
+        krakatoasr::INT64 expected = CountKept() + mergedOut;
+        if (particleCount != expected)
+        {
+            throw std::runtime_error(string("particle count after ") + pass + " was " + CountText(particleCount).GetAsciiString() +
+                " but " + CountText(expected).GetAsciiString() + " particles are kept: " + cloudName.GetAsciiString());
+        }
+    }
+
+    /*
+    Decides which points make it to krakatoa, has to run before the stream is handed to the renderer
+    since it changes particle_count(). The validation and the culling are done in one pass over each block
+    while it's hot in the cache.
+    */
+    void SelectParticles()
+    {
+        int positionChannel = FindChannel("Position", siICENodeDataVector3);
+        int densityChannel  = FindChannel("Density", siICENodeDataFloat);
+        int colorChannel    = FindChannel("Color", siICENodeDataColor4);
+
+        bool cull             = options.pCuller != 0 && positionChannel >= 0;
+        bool rejectPositions  = options.rejectEmpty && positionChannel >= 0;
+        bool rejectDensity    = options.rejectEmpty && densityChannel >= 0 && options.additiveMode == false && (options.emissionEnabled == false || (FindChannel("Emission", siICENodeDataVector3) < 0 && FindChannel("Emission", siICENodeDataColor4) < 0));
+        bool rejectColor      = options.rejectTransparent && colorChannel >= 0;
+        if (cull == false && rejectPositions == false && rejectDensity == false && rejectColor == false)
+            return;
+
+        keepMask.assign((size_t)((pointCount + 31) / 32), 0);
+        vector<unsigned char> flags((size_t)PACK_BLOCK_SIZE);
+        krakatoasr::INT64 rejected = 0;
+        krakatoasr::INT64 culled = 0;
+
+        for (krakatoasr::INT64 block = 0; block < GetBlockCount(); ++block)
+        {
+            krakatoasr::INT64 first = block * PACK_BLOCK_SIZE;
+            krakatoasr::INT64 count = min(PACK_BLOCK_SIZE, pointCount - first);
+
+            fill(flags.begin(), flags.end(), 1);
+            if (rejectPositions)
+                rejected += RejectNonFinitePositions(copiers[positionChannel].pSource + first * copiers[positionChannel].sourceStride, copiers[positionChannel].sourceStride, count, &flags[0]);
+            if (rejectDensity)
+                rejected += RejectEmptyDensity(copiers[densityChannel].pSource + first * copiers[densityChannel].sourceStride, copiers[densityChannel].sourceStride, count, &flags[0]);
+            if (rejectColor)
+                rejected += RejectTransparentColor(copiers[colorChannel].pSource + first * copiers[colorChannel].sourceStride, copiers[colorChannel].sourceStride, count, &flags[0]);
+            if (cull)
+                culled += options.pCuller->Cull(copiers[positionChannel].pSource + first * copiers[positionChannel].sourceStride, copiers[positionChannel].sourceStride, count, &flags[0]);
+
+            for (krakatoasr::INT64 i = 0; i < count; ++i)
             {
-                delete ptr;
-                ptr = 0;
+                if (flags[(size_t)i] != 0)
+                    keepMask[(size_t)((first + i) >> 5)] |= 1u << ((first + i) & 31);
             }
         }
+
+        particleCount = pointCount - culled - rejected;
+        CheckParticleCount("selection");
+        if (rejectPositions || rejectDensity || rejectColor)
+            Application().LogMessage(CString("Rejected ") + CountText(rejected) + CString(" of ") + CountText(pointCount) + CString(" particles that contribute nothing: ") + cloudName, siInfoMsg);
+        if (cull)
+            Application().LogMessage(CString("Culled ") + CountText(culled) + CString(" of ") + CountText(pointCount) + CString(" particles outside the camera view: ") + cloudName, siInfoMsg);
     }
 
-    void ScanForChannels()
+    /*
+    Hands krakatoa only about fraction of the selected particles, picked by a hash of their index so they are spread over the whole cloud.
+    Used by the preview passes, a fraction of 1 goes back to everything SelectParticles kept. The stream has to be closed in between.
+    */
+    void SetSubset(float fraction)
     {
-        CStatus res;
-        CPointRefArray points( geometry.GetPoints() );
-        particleCount = points.GetCount();
+        if (subsetActive)
+        {
+            keepMask.swap(fullMask);
+            fullMask.clear();
+            particleCount = fullParticleCount;
+            mergedPicks.clear();
+            mergedOut = mergedCount;
+            subsetActive = false;
+        }
+        if (fraction >= 1.0f || particleCount == 0)
+            return;
 
-        attributes.clear();
-        channels.clear();
+        fullMask.swap(keepMask);
+        fullParticleCount = particleCount;
+        subsetActive = true;
 
-		if (particleCount == 0) // don't scan for anything if the point cloud is empty
-		{
-			Application().LogMessage(CString("Point cloud is empty skipping channel mapping: ") + geometry.GetName() , siInfoMsg);
-			return;
-		}
-		
-        
-        CRefArray attributesRefArray = geometry.GetICEAttributes();
-        for (int i=0; i < attributesRefArray.GetCount(); i++)
+        unsigned int threshold = fraction > 0.0f ? (unsigned int)(fraction * 4294967295.0) : 0;
+        keepMask.assign((size_t)((pointCount + 31) / 32), 0);
+        particleCount = 0;
+        for (krakatoasr::INT64 i = 0; i < pointCount; ++i)
         {
-            ICEAttribute attr(attributesRefArray[i]);
-            string attrName  = attr.GetName().GetAsciiString();
+            bool selected = fullMask.empty() || (fullMask[(size_t)(i >> 5)] & (1u << (i & 31))) != 0;
+            if (selected && HashIndex((unsigned __int64)i) < threshold)
+            {
+                keepMask[(size_t)(i >> 5)] |= 1u << (i & 31);
+                particleCount++;
+            }
+        }
+
+        const unsigned __int64 MERGED_SEED = 2;
+        for (krakatoasr::INT64 i = 0; i < mergedCount; ++i)
+        {
+            if (HashIndex((unsigned __int64)i, MERGED_SEED) < threshold)
+                mergedPicks.push_back(i);
+        }
+        mergedOut = (krakatoasr::INT64)mergedPicks.size();
+        particleCount += mergedOut;
+    }
+
+    // how one channel of the merged particle is made from the particles going into it
+    enum MergeMode { MERGE_AVERAGE, MERGE_SUM, MERGE_DENSEST };
+    struct MergeRule
+    {
+        int offset;
+        data_type_t type;
+        int arity;
+        MergeMode mode;
+    };
+
+    struct MergePoint
+    {
+        unsigned __int64 key;
+        krakatoasr::INT64 index;
+        bool operator<(const MergePoint& other) const
+        {
+            return key < other.key || (key == other.key && index < other.index);
+        }
+    };
 
-            bool defined = attr.IsDefined();
-            siICENodeContextType context = attr.GetContextType();
-            
-            if (defined == false || context != siICENodeContextComponent0D)
+    // shared by the merge threads, binning task t fills buckets[t][partition]
+    struct MergeState
+    {
+        SIPointCloudParticleStream* pStream;
+        int tasks;
+        int positionChannel;
+        int densityOffset;
+        vector<MergeRule> rules;
+        vector<vector<vector<MergePoint> > > buckets;
+        vector<vector<char> > merged;                 // records made by each partition
+        vector<vector<krakatoasr::INT64> > dropped;   // points each partition merged away
+    };
+
+    static void BinPointsTask(void* pParam, int task)
+    {
+        MergeState& state = *(MergeState*)pParam;
+        const SIPointCloudParticleStream& stream = *state.pStream;
+        const ChannelCopier& position = stream.copiers[state.positionChannel];
+        krakatoasr::INT64 first = stream.pointCount * task / state.tasks;
+        krakatoasr::INT64 last  = stream.pointCount * (task + 1) / state.tasks;
+        vector<vector<MergePoint> >& buckets = state.buckets[task];
+        for (krakatoasr::INT64 i = first; i < last; ++i)
+        {
+            if (stream.IsKept(i) == false)
                 continue;
+            MergePoint point;
+            point.key = stream.options.pMergeGrid->CellKey((const float*)(position.pSource + i * position.sourceStride));
+            if (point.key == NO_MERGE_CELL)
+                continue;
+            point.index = i;
+            buckets[HashIndex(point.key) % (unsigned int)state.tasks].push_back(point);
+        }
+    }
+
+    static float ReadMergeValue(const char* pRecord, const MergeRule& rule, int component)
+    {
+        if (rule.type == DATA_TYPE_FLOAT16)
+            return HalfToFloat(((const unsigned short*)(pRecord + rule.offset))[component]);
+        return ((const float*)(pRecord + rule.offset))[component];
+    }
 
-            // TODO: ensure its only a supported type as well...
+    static void WriteMergeValue(char* pRecord, const MergeRule& rule, int component, float value)
+    {
+        if (rule.type == DATA_TYPE_FLOAT16)
+            ((unsigned short*)(pRecord + rule.offset))[component] = FloatToHalf(value);
+        else
+            ((float*)(pRecord + rule.offset))[component] = value;
+    }
 
-            // see if we have a mapping into krakatoa for this
-            map<string,string>::iterator pos =  channelNameMappings.find(attrName);
-            if (channelNameMappings.end() == pos)
+    // merges the points members[first], members[first + step], ... into one record appended to out
+    void MergeGroup(const MergeState& state, const vector<MergePoint>& members, size_t first, size_t end, size_t step, vector<char>& out) const
+    {
+        vector<char> record(recordSize + 16); // the copiers may write a few bytes past their channel
+        vector<char> densest(recordSize + 16);
+        vector<double> sums;
+        for (vector<MergeRule>::const_iterator i = state.rules.begin(); i != state.rules.end(); ++i)
+            sums.resize(sums.size() + i->arity * 2, 0.0); // weighted and unweighted sums of each component
+
+        double totalWeight = 0.0;
+        double count = 0.0;
+        float bestDensity = -FLT_MAX;
+        for (size_t m = first; m < end; m += step)
+        {
+            for (vector<ChannelCopier>::const_iterator i = copiers.begin(); i != copiers.end(); ++i)
+                i->copy(*i, members[m].index, &record[0]);
+
+            float density = *(const float*)(&record[0] + state.densityOffset);
+            double weight = density > 0.0f ? density : 0.0;
+            totalWeight += weight;
+            count += 1.0;
+            if (density > bestDensity)
             {
-                // channel is not supported by krakatoa so skip it
-                continue;
+                bestDensity = density;
+                memcpy(&densest[0], &record[0], recordSize);
             }
 
-            string krakName = pos->second;
-            channel_data data;
-            CBaseICEAttributeDataArray* dataArray;
+            size_t sum = 0;
+            for (vector<MergeRule>::const_iterator i = state.rules.begin(); i != state.rules.end(); ++i)
+            {
+                for (int c = 0; c < i->arity; ++c, sum += 2)
+                {
+                    double value = ReadMergeValue(&record[0], *i, c);
+                    sums[sum]     += value * weight;
+                    sums[sum + 1] += value;
+                }
+            }
+        }
 
-            switch (attr.GetDataType())
+        // the integer and bool channels come from the densest particle, the rest gets overwritten
+        size_t at = out.size();
+        out.resize(at + recordSize);
+        char* pOut = &out[at];
+        memcpy(pOut, &densest[0], recordSize);
+        size_t sum = 0;
+        for (vector<MergeRule>::const_iterator i = state.rules.begin(); i != state.rules.end(); ++i)
+        {
+            for (int c = 0; c < i->arity; ++c, sum += 2)
             {
-            case siICENodeDataBool:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_UINT8, 1);
-                dataArray = new CICEAttributeDataArrayBool();
-                break;
-            case siICENodeDataLong:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_INT32, 1);
-                dataArray = new CICEAttributeDataArrayLong();
-                break;
-            case siICENodeDataFloat:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 1);
-                dataArray = new CICEAttributeDataArrayFloat();
-                break;
-            case siICENodeDataVector2:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 2);
-                dataArray = new CICEAttributeDataArrayVector2f();
-                break;
-            case siICENodeDataVector3:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 3);
-                dataArray = new CICEAttributeDataArrayVector3f();
-                break;
-            case siICENodeDataVector4:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 4);
-                dataArray = new CICEAttributeDataArrayVector4f();
-                break;
-            case siICENodeDataQuaternion:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 4);
-                dataArray = new CICEAttributeDataArrayQuaternionf();
-                break;
-            case siICENodeDataColor4:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 3); // NOTE: krakatoa expected color to be just RGB, not alpha, this is a special case mis-map on purpose
-                dataArray = new CICEAttributeDataArrayColor4f();
-                break;
-            case siICENodeDataRotation:
-                data = this->append_channel(krakName.c_str(), DATA_TYPE_FLOAT32, 4); // store as quat xyzw
-                dataArray = new CICEAttributeDataArrayRotationf();
-                break;
-            default:
-                continue; // skip this channel if its not a supported data type
-                    
+                double value;
+                if (i->mode == MERGE_SUM)
+                    value = sums[sum + 1];
+                else if (totalWeight > 0.0)
+                    value = sums[sum] / totalWeight;
+                else
+                    value = sums[sum + 1] / count; // emission only particles, all weigh the same
+                WriteMergeValue(pOut, *i, c, (float)value);
+            }
+        }
+    }
+
+    static void MergeCellsTask(void* pParam, int task)
+    {
+        MergeState& state = *(MergeState*)pParam;
+        const SIPointCloudParticleStream& stream = *state.pStream;
+        size_t maxPerCell = (size_t)stream.options.mergeMaxPerCell;
+
+        vector<MergePoint> points;
+        for (int t = 0; t < state.tasks; ++t)
+        {
+            vector<MergePoint>& bucket = state.buckets[t][task];
+            points.insert(points.end(), bucket.begin(), bucket.end());
+            vector<MergePoint>().swap(bucket);
+        }
+        sort(points.begin(), points.end());
+
+        for (size_t start = 0; start < points.size(); )
+        {
+            size_t end = start + 1;
+            while (end < points.size() && points[end].key == points[start].key)
+                end++;
+            if (end - start > maxPerCell)
+            {
+                // every maxPerCell'th particle goes into the same merged one
+                for (size_t group = 0; group < maxPerCell; ++group)
+                    stream.MergeGroup(state, points, start + group, end, maxPerCell, state.merged[task]);
+                for (size_t i = start; i < end; ++i)
+                    state.dropped[task].push_back(points[i].index);
+            }
+            start = end;
+        }
+    }
+
+    /*
+    Replaces the particles crowded into a cell of options.pMergeGrid with at most options.mergeMaxPerCell merged ones.
+    Density and Emission add up, the other float channels are averaged weighted by density and the integer and bool
+    channels come from the densest particle. Points are binned into partitions by cell on one set of threads, then each
+    partition is sorted and merged on another.
+    */
+    void MergeDenseCells()
+    {
+        if (WillMerge() == false || particleCount == 0)
+            return;
+
+        MergeState state;
+        state.pStream         = this;
+        state.positionChannel = FindChannel("Position", siICENodeDataVector3);
+        int densityChannel    = FindChannel("Density", siICENodeDataFloat);
+        if (state.positionChannel < 0 || densityChannel < 0 || channelStorage[densityChannel] != DATA_TYPE_FLOAT32)
+            return;
+        state.densityOffset = copiers[densityChannel].byteOffset;
+
+        for (size_t i = 0; i < copiers.size(); ++i)
+        {
+            if (channelStorage[i] != DATA_TYPE_FLOAT32 && channelStorage[i] != DATA_TYPE_FLOAT16)
+                continue; // MERGE_DENSEST, already in the record it starts from
+            MergeRule rule;
+            rule.offset = copiers[i].byteOffset;
+            rule.type   = channelStorage[i];
+            rule.arity  = copiers[i].dataSize / (rule.type == DATA_TYPE_FLOAT16 ? (int)sizeof(unsigned short) : (int)sizeof(float));
+            rule.mode   = channelNames[i] == "Density" || channelNames[i] == "Emission" ? MERGE_SUM : MERGE_AVERAGE;
+            state.rules.push_back(rule);
+        }
+
+        state.tasks = max(1, GetWorkerThreadCount(options.packThreads));
+        state.buckets.resize(state.tasks, vector<vector<MergePoint> >(state.tasks));
+        state.merged.resize(state.tasks);
+        state.dropped.resize(state.tasks);
+        RunParallelTasks(&BinPointsTask, &state, state.tasks);
+        RunParallelTasks(&MergeCellsTask, &state, state.tasks);
+
+        if (keepMask.empty())
+            keepMask.assign((size_t)((pointCount + 31) / 32), 0xFFFFFFFF);
+        krakatoasr::INT64 droppedCount = 0;
+        for (int t = 0; t < state.tasks; ++t)
+        {
+            for (vector<krakatoasr::INT64>::const_iterator i = state.dropped[t].begin(); i != state.dropped[t].end(); ++i)
+                keepMask[(size_t)(*i >> 5)] &= ~(1u << (*i & 31));
+            droppedCount += (krakatoasr::INT64)state.dropped[t].size();
+            mergedRecords.insert(mergedRecords.end(), state.merged[t].begin(), state.merged[t].end());
+        }
+        mergedCount = recordSize > 0 ? (krakatoasr::INT64)(mergedRecords.size() / recordSize) : 0;
+        mergedOut   = mergedCount;
+
+        krakatoasr::INT64 before = particleCount;
+        particleCount = particleCount - droppedCount + mergedCount;
+        CheckParticleCount("merging");
+        if (droppedCount > 0)
+            Application().LogMessage(CString("Merged ") + CountText(droppedCount) + CString(" particles in crowded cells into ") + CountText(mergedCount) +
+                CString(", ") + CountText(before) + CString(" particles down to ") + CountText(particleCount) +
+                CString(" (") + CValue((double)particleCount / (double)before).GetAsText() + CString(" of the original): ") + cloudName, siInfoMsg);
+    }
+
+    /*
+    Level of detail, permanently drops all but about fraction of the particles SelectParticles kept.
+    They are picked by a hash of their ICE ID when the cloud has one, so the same particles survive from frame to frame
+    while others are born and die, otherwise by their index. The IDs were copied out with the channels.
+    */
+    void ApplyLOD(float fraction)
+    {
+        if (fraction >= 1.0f || particleCount == 0)
+            return;
+
+        const unsigned __int64 LOD_SEED = 1; // the preview subset hashes the index without a seed
+        unsigned int threshold = fraction > 0.0f ? (unsigned int)(fraction * 4294967295.0) : 0;
+        if (keepMask.empty())
+            keepMask.assign((size_t)((pointCount + 31) / 32), 0xFFFFFFFF);
+
+        bool useIDs = ids.empty() == false;
+        const LONG* pIDs = useIDs ? &ids[0] : 0;
+        krakatoasr::INT64 kept = 0;
+        for (krakatoasr::INT64 point = 0; point < pointCount; ++point)
+        {
+            if (IsKept(point) == false)
+                continue;
+            unsigned __int64 key = pIDs != 0 ? (unsigned __int64)(unsigned int)pIDs[point] : (unsigned __int64)point;
+            if (HashIndex(key, LOD_SEED) < threshold)
+                kept++;
+            else
+                keepMask[(size_t)(point >> 5)] &= ~(1u << (point & 31));
+        }
+
+        Application().LogMessage(CString("Level of detail kept ") + CountText(kept) + CString(" of ") + CountText(particleCount) + CString(" particles") + CString(useIDs ? " (by ID): " : ": ") + cloudName, siInfoMsg);
+        particleCount = kept;
+        CheckParticleCount("level of detail");
+    }
+
+    // grows the box to hold every point krakatoa gets from ICE
+    void AccumulateBounds(float boundsMin[3], float boundsMax[3])
+    {
+        int positionChannel = FindChannel("Position", siICENodeDataVector3);
+        if (positionChannel < 0 || particleCount == 0)
+            return;
+
+        for (krakatoasr::INT64 block = 0; block < GetBlockCount(); ++block)
+        {
+            const ChannelCopier& position = copiers[positionChannel];
+            krakatoasr::INT64 first = block * PACK_BLOCK_SIZE;
+            krakatoasr::INT64 count = min(PACK_BLOCK_SIZE, pointCount - first);
+            for (krakatoasr::INT64 i = first; i < first + count; ++i)
+            {
+                if (IsKept(i) == false)
+                    continue;
+                const float* p = (const float*)(position.pSource + i * position.sourceStride);
+                if ((fabs(p[0]) <= FLT_MAX && fabs(p[1]) <= FLT_MAX && fabs(p[2]) <= FLT_MAX) == false)
+                    continue; // NaN/Inf when they weren't rejected
+                for (int k = 0; k < 3; ++k)
+                {
+                    boundsMin[k] = min(boundsMin[k], p[k]);
+                    boundsMax[k] = max(boundsMax[k], p[k]);
+                }
             }
+        }
+    }
+
+    virtual krakatoasr::INT64 GetBlockCount() const
+    {
+        return (pointCount + PACK_BLOCK_SIZE - 1) / PACK_BLOCK_SIZE;
+    }
+    virtual size_t GetBlockBytes() const
+    {
+        return (size_t)(PACK_BLOCK_SIZE * recordStride);
+    }
+    // transposes a block of particles out of the ICE arrays into interleaved records
+    virtual krakatoasr::INT64 PackBlock(krakatoasr::INT64 block, char* pRecords) const
+    {
+        krakatoasr::INT64 first = block * PACK_BLOCK_SIZE;
+        krakatoasr::INT64 count = min(PACK_BLOCK_SIZE, pointCount - first);
+
+        for (vector<ChannelCopier>::const_iterator i = copiers.begin(); i != copiers.end(); ++i)
+            i->pack(*i, first, count, pRecords, recordStride);
 
-            Application().LogMessage(CString("Mapping channel: ") + CString(attr.GetName()) + CString(" ") +  CString(krakName.c_str()) ,siInfoMsg);
+        if (keepMask.empty())
+            return count;
 
-            this->channels.push_back(data);
-            this->attributes.push_back(attr);
-            attr.GetDataArray(*dataArray);
-            this->dataArrays.push_back(dataArray);
+        // squeeze out the records of the points that were dropped
+        krakatoasr::INT64 kept = 0;
+        for (krakatoasr::INT64 i = 0; i < count; ++i)
+        {
+            if (IsKept(first + i))
+            {
+                if (kept != i)
+                    memcpy(pRecords + kept * recordStride, pRecords + i * recordStride, recordSize);
+                kept++;
+            }
+        }
+        return kept;
+    }
+    void StopPipeline()
+    {
+        if (pPipeline != 0)
+        {
+            delete pPipeline;
+            pPipeline = 0;
+        }
+    }
+    // moves on to the next block the worker threads packed, false once every block has been handed out
+    bool StageNextBlock()
+    {
+        if (stagedBlock + 1 >= GetBlockCount())
+            return false;
+        if (pPipeline == 0)
+            pPipeline = new ParticlePackPipeline(*this, GetWorkerThreadCount(options.packThreads));
+
+        if (stagedBlock >= 0)
+            pPipeline->ReleaseBlock(stagedBlock);
+        stagedBlock++;
+        pStaged = pPipeline->AcquireBlock(stagedBlock, stagedCount);
+        stagedCursor = 0;
+        return true;
+    }
+    // fills krakatoa's particle straight from the ICE arrays, every value is only touched once.
+    // false if the mask ran out of kept points
+    bool CopyNextParticle(char* pParticle)
+    {
+        // skip the points that were dropped, a whole word of the mask at a time where possible
+        while (pointIndex < pointCount && keepMask.empty() == false && IsKept(pointIndex) == false)
+        {
+            if ((pointIndex & 31) == 0 && keepMask[(size_t)(pointIndex >> 5)] == 0)
+                pointIndex += 32;
+            else
+                pointIndex++;
         }
+        if (pointIndex >= pointCount)
+            return false;
+
+        for (vector<ChannelCopier>::const_iterator i = copiers.begin(); i != copiers.end(); ++i)
+            i->copy(*i, pointIndex, pParticle);
+        pointIndex++;
+        return true;
     }
+    const vector<AppendedChannel>& GetAppendedChannels() const
+    {
+        return appendedChannels;
+    }
+
     virtual krakatoasr::INT64 particle_count() const 
     {
         if (this->particleCount == -1)
-            throw std::exception("particle_count() called before attributes were scanned");
+            throw std::runtime_error("particle_count() called before attributes were scanned");
         return this->particleCount;
     }
     virtual bool get_next_particle( void* particleData ) 
     {
-        // use to temp copy values from the data array
-        static unsigned char pBuff[100];
-        float* pFloatBuff = (float*)pBuff;
-        LONG* pLONGBuff = (LONG*)pBuff;
+        if (particleIndex >= particleCount)
+            return false;
+
+        if (particleIndex >= particleCount - mergedOut)
+        {
+            // the merged particles go out after the ICE ones
+            krakatoasr::INT64 record = mergedPicks.empty() ? mergedIndex : mergedPicks[(size_t)mergedIndex];
+            memcpy(particleData, &mergedRecords[(size_t)(record * recordSize)], recordSize);
+            mergedIndex++;
+        }
+        else if (options.pipelined)
+        {
+            while (stagedCursor == stagedCount)
+            {
+                if (StageNextBlock() == false)
+                    throw std::runtime_error("particle stream ran out of packed blocks before particle_count() particles");
+            }
+
+            memcpy(particleData, pStaged + (size_t)(stagedCursor * recordStride), recordSize);
+            stagedCursor++;
+        }
+        else
+        {
+            if (CopyNextParticle((char*)particleData) == false)
+                throw std::runtime_error("particle stream ran out of kept points before particle_count() particles");
+        }
+
+        particleIndex++;
+        return true;
+    }
+    virtual void close() 
+    {
+        StopPipeline();
+        particleIndex = 0;
+        pointIndex    = 0;
+        mergedIndex   = 0;
+        stagedBlock   = -1;
+        stagedCount   = 0;
+        stagedCursor  = 0;
+        pStaged       = 0;
+    }
+};
+
+map<string,string> SIPointCloudParticleStream::channelNameMappings;
+const krakatoasr::INT64 SIPointCloudParticleStream::PACK_BLOCK_SIZE;
+
+/*
+What krakatoa gets for one pass of a progressive preview. Every pass adds its own so the final pass doesn't rely on
+the renderer reading a stream again after it has been closed, and they all read the same SIPointCloudParticleStream
+so nothing is ingested twice. Once its pass is over a pass stream is expired and comes up empty, in case the renderer
+holds on to the streams of the last render.
+*/
+class PassParticleStream : public particle_stream_interface
+{
+protected:
+	SIPointCloudParticleStream& stream;
+	bool expired;
+
+public:
+	PassParticleStream(SIPointCloudParticleStream& stream) :
+		stream(stream),
+		expired(false)
+	{
+		const vector<AppendedChannel>& channels = stream.GetAppendedChannels();
+		for (vector<AppendedChannel>::const_iterator i = channels.begin(); i != channels.end(); ++i)
+		{
+			channel_data data = this->append_channel(i->name.c_str(), i->type, i->arity);
+			if ((int)data.byteOffset != i->byteOffset)
+				throw std::runtime_error("preview pass stream doesn't lay out its particles like the point cloud stream");
+		}
+	}
+
+	virtual ~PassParticleStream()
+	{
+	}
+
+	void Expire()
+	{
+		expired = true;
+	}
+
+	virtual krakatoasr::INT64 particle_count() const
+	{
+		return expired ? 0 : stream.particle_count();
+	}
+	virtual bool get_next_particle(void* particleData)
+	{
+		return expired ? false : stream.get_next_particle(particleData);
+	}
+	virtual void close()
+	{
+		if (expired == false)
+			stream.close();
+	}
+};
+
+// adds a pass stream to the renderer for every point cloud stream that has particles in this pass
+void AddPassStreams(krakatoa_renderer& renderer, vector<SIPointCloudParticleStream*>& streams, vector<PassParticleStream*>& passStreams)
+{
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+	{
+		if ((*i)->particle_count() == 0)
+			continue;
+		PassParticleStream* pPass = new PassParticleStream(**i);
+		passStreams.push_back(pPass);
+		renderer.add_particle_stream(particle_stream::create_from_particle_stream_interface(pPass));
+	}
+}
+
+/*
+Copies the ICE data every stream fetched into buffers the plugin owns, so nothing has to read ICE once the scene is unlocked.
+The arrays were fetched one at a time on this thread since the SDK isn't safe to call from any other, but once they're
+fetched it's just memory, so the copies of all the clouds are spread over as many threads as there are cores.
+Only streams with options.snapshot have anything to copy besides their IDs, the copies stay around until the render is
+done on top of what ICE holds, which is why it's left to the UnlockSceneEarly option (or a cache that needs them anyway).
+*/
+void SnapshotParticleStreams(vector<SIPointCloudParticleStream*>& streams)
+{
+	SnapshotJob job;
+	job.next = 0;
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+		(*i)->GetSnapshotCopies(job.copies);
+
+	size_t bytes = 0;
+	for (vector<SnapshotCopy>::const_iterator i = job.copies.begin(); i != job.copies.end(); ++i)
+		bytes += i->bytes;
+	if (job.copies.empty() == false)
+	{
+		sort(job.copies.begin(), job.copies.end(), CompareSnapshotCopySize);
+		DWORD started = GetTickCount();
+		int tasks = bytes >= 16 * 1024 * 1024 ? min((int)job.copies.size(), GetWorkerThreadCount(0) + 1) : 1; // small ones aren't worth the threads
+		RunParallelTasks(&SnapshotTask, &job, tasks);
+		Application().LogMessage(CString("Copied ") + CountText(bytes / 1024) + CString(" KB of ICE data out of the scene on ") + CountText(tasks) + CString(" threads in ") + CValue((LONG)(GetTickCount() - started)).GetAsText() + CString(" ms, held on top of ICE's own until the render is done"), siInfoMsg);
+	}
+
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+		(*i)->FinishSnapshot();
+}
+
+// true if name is the object or anything under it
+bool IsUnder(const CString& name, const CString& objectName)
+{
+	CString prefix = objectName + CString(".");
+	return name == objectName || name.GetSubString(0, prefix.Length()) == prefix;
+}
+
+// true if nothing in the render's dirty list could have changed the object (the ICE data of a cloud, a mesh's geometry).
+// only krakatoa's own render options, lights and shaders are known not to, an ICE tree can read a camera or any other property.
+// cameraName is the render camera when the user says no ICE tree reads it (empty otherwise), then changes to the camera
+// itself are let through as well. Moving a camera rig's root or interest still counts as a change.
+bool IsObjectUnchanged(const CRefArray& dirtyList, const CString& objectName, const CString& rendererPropName, const CString& cameraName)
+{
+	for (LONG i = 0; i < dirtyList.GetCount(); ++i)
+	{
+		const CRef& ref = dirtyList[i];
+		CString name = ref.GetAsText();
+		if (IsUnder(name, objectName))
+			return false;
+		if (IsUnder(name, rendererPropName) || ref.IsA(siLightID) || ref.IsA(siShaderID))
+			continue;
+		if (cameraName.IsEmpty() == false && IsUnder(name, cameraName))
+			continue;
+		return false;
+	}
+	return true;
+}
+
+/*
+Channels that hold the same value for every particle are folded into the renderer settings instead of being copied per particle.
+Krakatoa multiplies the Density channel into both density per particle settings, so a Density shared by every cloud
+can move there. Emission and Color can't fold the same way, a missing Emission channel means no emission
+and there is no global color, so only the constants that match krakatoa's defaults get dropped.
+*/
+// returns what the density per particle settings were multiplied by, 1 if nothing was folded
+float FoldConstantChannels(krakatoa_renderer& renderer, float densityPerParticle, float lightingDensityPerParticle, vector<SIPointCloudParticleStream*>& streams)
+{
+	float density = 0.0f;
+	bool uniformDensity = streams.empty() == false;
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end() && uniformDensity; ++i)
+	{
+		float value = 0.0f;
+		// a density of 0 stays per particle so the empty particle rejection still sees it
+		if ((*i)->GetConstantChannel("Density", siICENodeDataFloat, &value) == false || (value > 0.0f) == false || (i != streams.begin() && value != density))
+			uniformDensity = false;
+		density = value;
+	}
+
+	if (uniformDensity && density != 1.0f)
+	{
+		renderer.set_density_per_particle(densityPerParticle * density);
+		renderer.set_lighting_density_per_particle(lightingDensityPerParticle * density);
+		Application().LogMessage(CString("Folded constant Density of ") + CValue(density).GetAsText() + CString(" into the density per particle"), siInfoMsg);
+	}
+
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+	{
+		if (uniformDensity)
+			(*i)->DropChannel("Density", "folded into density per particle");
+		(*i)->DropDefaultChannels();
+	}
+	return uniformDensity ? density : 1.0f;
+}
 
-        for (int i=0; i < channels.size(); ++i)
-        {
-            // TODO: refactor to use iterators
-            ICEAttribute& attr = attributes[i];
-            channel_data& cd   = channels[i];
-            CBaseICEAttributeDataArray* pDataArray = dataArrays[i];
-                        
-            switch (attr.GetDataType())
-            {
-                case siICENodeDataLong:
-                {
-                    set_channel_value(cd, particleData, &(*((CICEAttributeDataArrayLong*)pDataArray))[(ULONG)particleIndex]);
-                    break;
-                }
-                case siICENodeDataFloat:
-                {
-                    set_channel_value(cd, particleData, &(*((CICEAttributeDataArrayFloat*)pDataArray))[(ULONG)particleIndex]);
-                    break;
-                }
-                case siICENodeDataVector3:
-                {
-                    set_channel_value(cd, particleData, &(*((CICEAttributeDataArrayVector3f*)pDataArray))[(ULONG)particleIndex]);
-                    break;
-                }
-                case siICENodeDataVector4:
-                {
-                    set_channel_value(cd, particleData, &(*((CICEAttributeDataArrayVector4f*)pDataArray))[(ULONG)particleIndex]);
-                    break;
-                }
-                case siICENodeDataColor4:
-                {
-                    set_channel_value(cd, particleData, &(*((CICEAttributeDataArrayColor4f*)pDataArray))[(ULONG)particleIndex]);
-                    break;
-                }
-              /*
-			   TODO: support these....
-			   case siICENodeDataQuaternion:
-                    storeData<CICEAttributeDataArrayQuaternionf,float>(attr,pPD, partioAttr);
-                    break;
-                case siICENodeDataRotation:
-                    storeData<CICEAttributeDataArrayRotationf ,float>(attr,pPD, partioAttr);
-                    break;*/
-            }
-        }
-        
-        particleIndex++;
-        return particleIndex <= particleCount;
-    }
-    virtual void close() 
-    {
-        particleIndex = 0;
-    }
-};
+/*
+Keeps a fixed fraction of the particles (ParticleLOD 1) or as many as fit in a budget across all the clouds (ParticleLOD 2).
+Returns the fraction actually kept, the caller scales density and emission by its inverse since they are global settings.
+A budget gives a different fraction whenever the particle count changes, a fixed ratio keeps the same particles every frame.
+The settings are read by the caller since this runs once the scene has been unlocked.
+*/
+float ApplyParticleLOD(int mode, float ratio, LONG budget, vector<SIPointCloudParticleStream*>& streams)
+{
+	if (mode == 0) // 0 = off, 1 = ratio, 2 = budget
+		return 1.0f;
+
+	krakatoasr::INT64 before = 0;
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+		before += (*i)->particle_count();
+	if (before == 0)
+		return 1.0f;
+
+	float fraction = 1.0f;
+	if (mode == 1)
+		fraction = ratio;
+	else
+		fraction = (float)((double)budget / (double)before);
+	if (fraction >= 1.0f)
+		return 1.0f;
+	fraction = max(fraction, 1e-6f);
 
-map<string,string> SIPointCloudParticleStream::channelNameMappings;
+	krakatoasr::INT64 after = 0;
+	for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+	{
+		(*i)->ApplyLOD(fraction);
+		after += (*i)->particle_count();
+	}
+	if (after == 0)
+		return 1.0f; // nothing to compensate for
+
+	float kept = (float)((double)after / (double)before);
+	Application().LogMessage(CString("Level of detail kept ") + CountText(after) + CString(" of ") + CountText(before) + CString(" particles, density and emission scaled by ") + CValue(1.0f / kept).GetAsText(), siInfoMsg);
+	return kept;
+}
 
 class SILogger : public krakatoasr::logging_interface
 {
@@ -548,8 +3313,9 @@ void SetupLight(krakatoasr::light& klight, CString& name, XSI::MATH::CColor4f& c
 	}
 }
 
-void AddLight(krakatoasr::krakatoa_renderer& renderer, Light& light)
+void AddLight(krakatoasr::krakatoa_renderer& renderer, Light& light, vector<LightPlacement>* pPlacements = 0)
 {
+	g_sceneGuard.NoteRead("light");
 	Primitive lightPrim = light.GetActivePrimitive();
 
 	float intensity = 0.75;
@@ -587,6 +3353,18 @@ void AddLight(krakatoasr::krakatoa_renderer& renderer, Light& light)
 		}
 	}
 		
+	if (pPlacements != 0 && type >= 0 && type <= 2)
+	{
+		MATH::CMatrix4 lightTM = light.GetKinematics().GetGlobal().GetTransform().GetMatrix4();
+		LightPlacement placement;
+		placement.directional = type == 1;
+		int row = placement.directional ? 2 : 3; // the light's Z axis or its position
+		placement.x = (float)lightTM.GetValue(row, 0);
+		placement.y = (float)lightTM.GetValue(row, 1);
+		placement.z = (float)lightTM.GetValue(row, 2);
+		pPlacements->push_back(placement);
+	}
+
 	switch (type)
 	{
 		case 0: // Point
@@ -667,146 +3445,1053 @@ void SetShaderFromProperty(krakatoasr::krakatoa_renderer& renderer, Property& pr
 		shader.use_specular_level_channel(prop.GetParameter("UseSpecularLevelChannel").GetValue());
 		shader.use_specular_power_channel(prop.GetParameter("UseSpecularPowerChannel").GetValue());
 
-		renderer.set_shader(&shader); // makes a copy so we don't need to keep shader around
+		renderer.set_shader(&shader); // makes a copy so we don't need to keep shader around
+	}
+	else if (shader == 5)
+	{
+		// this one sucks....
+		shader_marschner shader;
+		shader.set_specular_glossiness(prop.GetParameter("SpecularGlossiness").GetValue());
+		shader.set_specular_level(prop.GetParameter("SpecularLevel").GetValue());
+		shader.set_specular_shift(prop.GetParameter("SpecularShift").GetValue());
+
+		shader.set_secondary_specular_glossiness(prop.GetParameter("SecondarySpecularGlossiness").GetValue());
+		shader.set_secondary_specular_level(prop.GetParameter("SecondarySpecularLevel").GetValue());
+		shader.set_secondary_specular_shift(prop.GetParameter("SecondarySpecularShift").GetValue());
+
+		shader.set_glint_level(prop.GetParameter("GlintLevel").GetValue());
+		shader.set_glint_size(prop.GetParameter("GlintSize").GetValue());
+		shader.set_glint_glossiness(prop.GetParameter("GlintGlossiness").GetValue());
+
+		shader.set_diffuse_level(prop.GetParameter("DiffuseLevel").GetValue());
+
+		shader.use_specular_glossiness_channel(prop.GetParameter("UseSpecularGlossinessChannel").GetValue());
+		shader.use_specular_level_channel(prop.GetParameter("UseSpecularLevelChannel").GetValue());
+		shader.use_specular_shift_channel(prop.GetParameter("UseSpecularShiftChannel").GetValue());
+
+		shader.use_secondary_specular_glossiness_channel(prop.GetParameter("UseSecondarySpecularGlossinessChannel").GetValue());
+		shader.use_secondary_specular_level_channel(prop.GetParameter("UseSecondarySpecularLevelChannel").GetValue());
+		shader.use_secondary_specular_shift_channel(prop.GetParameter("UseSecondarySpecularShiftChannel").GetValue());
+
+		shader.use_glint_level_channel(prop.GetParameter("UseGlintLevelChannel").GetValue());
+		shader.use_glint_size_channel(prop.GetParameter("UseGlintSizeChannel").GetValue());
+		shader.use_glint_glossiness_channel(prop.GetParameter("UseGlintGlossinessChannel").GetValue());
+
+		shader.use_diffuse_level_channel(prop.GetParameter("UseDiffuseLevelChannel").GetValue());
+
+		renderer.set_shader(&shader);
+	}
+}
+
+// works out which of the channels we map from ICE the shader, render elements and options set up
+// by the render settings will never read, keep in sync with SetShaderFromProperty
+void GetUnusedChannels(Property& prop, set<string>& unused)
+{
+	int shader = prop.GetParameter("Shader").GetValue();
+	bool phong      = shader == 1;
+	bool phaseShade = shader == 2 || shader == 3;
+	bool kajiyaKay  = shader == 4;
+	bool marschner  = shader == 5;
+	bool motionBlur = prop.GetParameter("UseMotionBlur").GetValue();
+
+	map<string, bool> used;
+	used["Emission"]            = prop.GetParameter("UseEmission").GetValue();
+	used["Absorption"]          = prop.GetParameter("UseAbsorbtionChannel").GetValue();
+	used["Velocity"]            = motionBlur || (bool)prop.GetParameter("Velocity").GetValue();
+	used["MBlurTime"]           = motionBlur;
+	used["Normal"]              = phong || kajiyaKay || marschner || (bool)prop.GetParameter("Normals").GetValue();
+	used["Tangent"]             = kajiyaKay || marschner;
+	used["Eccentricity"]        = phaseShade && (bool)prop.GetParameter("UseEccentricityChannel").GetValue();
+	used["SpecularPower"]       = (phong || kajiyaKay) && (bool)prop.GetParameter("UseSpecularPowerChannel").GetValue();
+	used["SpecularLevel"]       = (phong || kajiyaKay || marschner) && (bool)prop.GetParameter("UseSpecularLevelChannel").GetValue();
+	used["DiffuseLevel"]        = marschner && (bool)prop.GetParameter("UseDiffuseLevelChannel").GetValue();
+	used["GlintGlossiness"]     = marschner && (bool)prop.GetParameter("UseGlintGlossinessChannel").GetValue();
+	used["GlintLevel"]          = marschner && (bool)prop.GetParameter("UseGlintLevelChannel").GetValue();
+	used["GlintSize"]           = marschner && (bool)prop.GetParameter("UseGlintSizeChannel").GetValue();
+	used["Specular2Glossiness"] = marschner && (bool)prop.GetParameter("UseSecondarySpecularGlossinessChannel").GetValue();
+	used["Specular2Level"]      = marschner && (bool)prop.GetParameter("UseSecondarySpecularLevelChannel").GetValue();
+	used["Specular2Shift"]      = marschner && (bool)prop.GetParameter("UseSecondarySpecularShiftChannel").GetValue();
+	used["SpecularGlossiness"]  = marschner && (bool)prop.GetParameter("UseSpecularGlossinessChannel").GetValue();
+	used["SpecularShift"]       = marschner && (bool)prop.GetParameter("UseSpecularShiftChannel").GetValue();
+	// Position, Color, Density and Lighting are always needed
+
+	for (map<string, bool>::iterator i = used.begin(); i != used.end(); ++i)
+	{
+		if (i->second == false)
+			unused.insert(i->first);
+	}
+}
+
+/*
+Reference counted triangle_mesh. One mesh can be added to the renderer any number of times with different transforms,
+it's deleted when the last MeshRef to it goes away, which has to be after the renderer has been reset.
+*/
+class MeshRef
+{
+protected:
+	struct Shared
+	{
+		triangle_mesh* pMesh;
+		LONG refs;
+	};
+	Shared* pShared;
+
+	void Release()
+	{
+		if (pShared != 0 && InterlockedDecrement(&pShared->refs) == 0)
+		{
+			delete pShared->pMesh;
+			delete pShared;
+		}
+		pShared = 0;
+	}
+
+public:
+	MeshRef() : pShared(0)
+	{
+	}
+	// takes ownership of the mesh
+	explicit MeshRef(triangle_mesh* pMesh) : pShared(new Shared)
+	{
+		pShared->pMesh = pMesh;
+		pShared->refs  = 1;
+	}
+	MeshRef(const MeshRef& other) : pShared(other.pShared)
+	{
+		if (pShared != 0)
+			InterlockedIncrement(&pShared->refs);
+	}
+	~MeshRef()
+	{
+		Release();
+	}
+	MeshRef& operator=(const MeshRef& other)
+	{
+		if (other.pShared != 0)
+			InterlockedIncrement(&other.pShared->refs);
+		Release();
+		pShared = other.pShared;
+		return *this;
+	}
+	triangle_mesh* Get() const
+	{
+		return pShared != 0 ? pShared->pMesh : 0;
+	}
+};
+
+/*
+Occlusion meshes by what's in them, a hash of the triangles and the local vertex positions. Instances and clones of the
+same geometry find the same mesh so it's only built once, and kept between renders it's reused as long as the geometry
+doesn't change (moving the object only changes the transform that goes to the renderer with it).
+Hashing still means pulling the whole mesh out of Softimage, so the hash each object had is kept by its name as well,
+with the frame and render it's from. When the dirty list says the object hasn't changed since then the geometry isn't
+read at all, the mesh is found by name and culled as a whole by the local bounds kept with it.
+Meshes no render asked for since the last Sweep() are let go then, so it only ever holds what the scene is using.
+*/
+class OcclusionMeshCache
+{
+protected:
+	struct Entry
+	{
+		MeshRef mesh;
+		float boundsMin[3]; // of the local vertex positions
+		float boundsMax[3];
+		bool used;
+	};
+	map<unsigned __int64, Entry> entries;
+
+	struct NameEntry
+	{
+		unsigned __int64 hash;
+		double frame;
+		ULONG renderID; // the dirty list is only about changes since this render
+	};
+	map<string, NameEntry> names;
+
+public:
+	// the mesh built from the geometry with this hash, empty if there isn't one yet
+	MeshRef Find(unsigned __int64 hash)
+	{
+		map<unsigned __int64, Entry>::iterator i = entries.find(hash);
+		if (i == entries.end())
+			return MeshRef();
+		i->second.used = true;
+		return i->second.mesh;
+	}
+
+	// the local bounds the mesh was stored with, false if it isn't there
+	bool GetBounds(unsigned __int64 hash, float boundsMin[3], float boundsMax[3]) const
+	{
+		map<unsigned __int64, Entry>::const_iterator i = entries.find(hash);
+		if (i == entries.end())
+			return false;
+		for (int k = 0; k < 3; ++k)
+		{
+			boundsMin[k] = i->second.boundsMin[k];
+			boundsMax[k] = i->second.boundsMax[k];
+		}
+		return true;
+	}
+
+	void Store(unsigned __int64 hash, const MeshRef& mesh, const float boundsMin[3], const float boundsMax[3])
+	{
+		Entry& entry = entries[hash];
+		entry.mesh = mesh;
+		for (int k = 0; k < 3; ++k)
+		{
+			entry.boundsMin[k] = boundsMin[k];
+			entry.boundsMax[k] = boundsMax[k];
+		}
+		entry.used = true;
+	}
+
+	// the hash of the mesh the named object had in the same frame and render, as long as that mesh is still here
+	bool FindName(const string& name, double frame, ULONG renderID, unsigned __int64& hash) const
+	{
+		map<string, NameEntry>::const_iterator i = names.find(name);
+		if (i == names.end() || i->second.frame != frame || i->second.renderID != renderID || entries.count(i->second.hash) == 0)
+			return false;
+		hash = i->second.hash;
+		return true;
+	}
+
+	void StoreName(const string& name, unsigned __int64 hash, double frame, ULONG renderID)
+	{
+		NameEntry& entry = names[name];
+		entry.hash     = hash;
+		entry.frame    = frame;
+		entry.renderID = renderID;
+	}
+
+	// the meshes only go once the last render holding a MeshRef to them is done with it as well
+	void Sweep()
+	{
+		for (map<unsigned __int64, Entry>::iterator i = entries.begin(); i != entries.end(); )
+		{
+			if (i->second.used)
+			{
+				i->second.used = false;
+				++i;
+			}
+			else
+			{
+				entries.erase(i++);
+			}
+		}
+		for (map<string, NameEntry>::iterator i = names.begin(); i != names.end(); )
+		{
+			if (entries.count(i->second.hash) == 0)
+				names.erase(i++);
+			else
+				++i;
+		}
+	}
+
+	void Clear()
+	{
+		entries.clear();
+		names.clear();
+	}
+};
+
+static OcclusionMeshCache g_occlusionMeshCache; // lives for the whole session
+
+// builds a mesh out of just the flagged triangles and the vertices they use
+triangle_mesh* BuildCulledMesh(const CDoubleArray& verts, const CLongArray& indices, const vector<unsigned char>& keep, int keptCount)
+{
+	vector<int> remap(verts.GetCount() / 3, -1);
+	vector<LONG> keptIndices;
+	keptIndices.reserve((size_t)keptCount * 3);
+	int keptVerts = 0;
+	for (size_t t = 0; t < keep.size(); ++t)
+	{
+		if (keep[t] == 0)
+			continue;
+		for (int k = 0; k < 3; ++k)
+		{
+			LONG index = indices[(LONG)(t * 3 + k)];
+			if (remap[index] < 0)
+				remap[index] = keptVerts++;
+			keptIndices.push_back(remap[index]);
+		}
+	}
+
+	triangle_mesh* pMesh = new triangle_mesh();
+	pMesh->set_num_vertices(keptVerts);
+	pMesh->set_num_triangle_faces(keptCount);
+	const double* pVerts = verts.GetArray();
+	for (size_t i = 0; i < remap.size(); ++i)
+	{
+		if (remap[i] >= 0)
+			pMesh->set_vertex_position(remap[i], (float)pVerts[i * 3 + 0], (float)pVerts[i * 3 + 1], (float)pVerts[i * 3 + 2]);
+	}
+	for (int i = 0; i < keptCount; ++i)
+		pMesh->set_face(i, keptIndices[i * 3 + 0], keptIndices[i * 3 + 1], keptIndices[i * 3 + 2]);
+	pMesh->set_visible_to_camera(true);
+	pMesh->set_visible_to_lights(true);
+	return pMesh;
+}
+
+// what AddOcclusionMesh needs of an occluder, read out of the scene while it's locked
+struct OccluderSnapshot
+{
+	CString name;
+	bool valid;
+	bool cached;             // the geometry wasn't read, the mesh in the cache under hash is still good
+	unsigned __int64 hash;
+	string cacheKey;         // the object's full name
+	double frame;
+	ULONG renderID;
+	int triCount;
+	int vertCount;
+	CLongArray indices;
+	CDoubleArray verts;
+	MATH::CMatrix4 tm;
+};
+
+// unchanged says the dirty list leaves the object alone, then the geometry is only read if the cache doesn't have it by name
+void ReadOcclusionMesh(X3DObject& obj3d, OccluderSnapshot& occluder, const OcclusionMeshCache& meshes, bool unchanged, double frame, ULONG renderID)
+{
+	g_sceneGuard.NoteRead("occlusion mesh");
+	occluder.name     = obj3d.GetName();
+	occluder.cacheKey = obj3d.GetFullName().GetAsciiString();
+	occluder.frame    = frame;
+	occluder.renderID = renderID;
+	occluder.valid    = false;
+	occluder.cached   = false;
+	occluder.hash     = 0;
+	occluder.tm       = obj3d.GetKinematics().GetGlobal().GetTransform().GetMatrix4();
+	if (unchanged && meshes.FindName(occluder.cacheKey, frame, renderID, occluder.hash))
+	{
+		occluder.cached = true;
+		occluder.valid  = true;
+		return;
+	}
+
+	Primitive& prim = obj3d.GetActivePrimitive();  // should be a polygon mesh
+	PolygonMesh geom = prim.GetGeometry();
+	if (geom.IsValid() == false)
+	{
+		Application().LogMessage(CString("Object is not a polygon mesh: ") + occluder.name, siWarningMsg);
+		return;
+	}
+	CGeometryAccessor ga = geom.GetGeometryAccessor();
+
+	occluder.triCount  = ga.GetTriangleCount();
+	occluder.vertCount = ga.GetVertexCount();
+	ga.GetTriangleVertexIndices(occluder.indices);
+	ga.GetVertexPositions(occluder.verts);
+	occluder.valid = true;
+}
+
+// world space bounding sphere of a local box
+void TransformedBoundingSphere(const MATH::CMatrix4& tm, const float boundsMin[3], const float boundsMax[3], float center[3], float& radius)
+{
+	float worldMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float worldMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (int corner = 0; corner < 8; ++corner)
+	{
+		double p[3] = { (corner & 1) ? boundsMax[0] : boundsMin[0], (corner & 2) ? boundsMax[1] : boundsMin[1], (corner & 4) ? boundsMax[2] : boundsMin[2] };
+		for (int k = 0; k < 3; ++k)
+		{
+			float value = (float)(p[0] * tm.GetValue(0, k) + p[1] * tm.GetValue(1, k) + p[2] * tm.GetValue(2, k) + tm.GetValue(3, k));
+			worldMin[k] = min(worldMin[k], value);
+			worldMax[k] = max(worldMax[k], value);
+		}
+	}
+	float r2 = 0.0f;
+	for (int k = 0; k < 3; ++k)
+	{
+		center[k] = (worldMin[k] + worldMax[k]) * 0.5f;
+		r2 += (worldMax[k] - center[k]) * (worldMax[k] - center[k]);
+	}
+	radius = sqrt(r2);
+}
+
+/*
+Adds the occluder as an occlusion mesh, taking the mesh from the cache when one with the same geometry is already there.
+With a culler, meshes that can't be seen or shadow any particles are skipped and only the triangles that matter
+are kept of the ones partly in the way. A cut down mesh depends on where the object is, so it's never shared.
+Occluders the snapshot took from the cache by name have no geometry to cut down, they're only culled as a whole.
+Only works from the snapshot, so it can run after the scene has been unlocked.
+*/
+MeshRef AddOcclusionMesh(krakatoa_renderer& renderer, const OccluderSnapshot& occluder, OcclusionMeshCache& meshes, const OccluderCuller* pCuller)
+{
+	if (occluder.valid == false)
+		return MeshRef();
+
+	if (occluder.cached)
+	{
+		float boundsMin[3];
+		float boundsMax[3];
+		if (pCuller != 0 && meshes.GetBounds(occluder.hash, boundsMin, boundsMax))
+		{
+			float center[3];
+			float radius;
+			TransformedBoundingSphere(occluder.tm, boundsMin, boundsMax, center, radius);
+			if (pCuller->SphereMatters(center, radius) == false)
+			{
+				Application().LogMessage(CString("Skipping unchanged occlusion mesh outside the camera and light volumes: ") + occluder.name, siInfoMsg);
+				return MeshRef();
+			}
+		}
+		MeshRef mesh = meshes.Find(occluder.hash);
+		Application().LogMessage(CString("Occlusion mesh unchanged since the last render, reusing it: ") + occluder.name, siInfoMsg);
+		renderer.add_mesh(mesh.Get(), Mat2AT(occluder.tm));
+		return mesh;
+	}
+
+	int triCount = occluder.triCount;
+	int vertCount = occluder.vertCount;
+	const CLongArray& indices = occluder.indices;
+	const CDoubleArray& verts = occluder.verts;
+
+	// the topology and the deformation both end up in the hash
+	unsigned __int64 hash = 14695981039346656037ULL;
+	hash = HashBytes((const char*)&triCount, sizeof(triCount), hash);
+	hash = HashBytes((const char*)&vertCount, sizeof(vertCount), hash);
+	if (indices.GetCount() > 0)
+		hash = HashBytes((const char*)indices.GetArray(), indices.GetCount() * sizeof(LONG), hash);
+	if (verts.GetCount() > 0)
+		hash = HashBytes((const char*)verts.GetArray(), verts.GetCount() * sizeof(double), hash);
+
+	MATH::CMatrix4 tm = occluder.tm;
+	if (pCuller != 0 && vertCount > 0 && triCount > 0)
+	{
+		vector<float> world((size_t)vertCount * 3);
+		const double* pVerts = verts.GetArray();
+		float boundsMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float boundsMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (int i = 0; i < vertCount; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				float value = (float)(pVerts[i * 3 + 0] * tm.GetValue(0, k) + pVerts[i * 3 + 1] * tm.GetValue(1, k) + pVerts[i * 3 + 2] * tm.GetValue(2, k) + tm.GetValue(3, k));
+				world[i * 3 + k] = value;
+				boundsMin[k] = min(boundsMin[k], value);
+				boundsMax[k] = max(boundsMax[k], value);
+			}
+		}
+
+		float center[3];
+		float r2 = 0.0f;
+		for (int k = 0; k < 3; ++k)
+		{
+			center[k] = (boundsMin[k] + boundsMax[k]) * 0.5f;
+			r2 += (boundsMax[k] - center[k]) * (boundsMax[k] - center[k]);
+		}
+		if (pCuller->SphereMatters(center, sqrt(r2)) == false)
+		{
+			Application().LogMessage(CString("Skipping occlusion mesh outside the camera and light volumes (") + CountText(triCount) + CString(" triangles): ") + occluder.name, siInfoMsg);
+			return MeshRef();
+		}
+
+		vector<unsigned char> keep((size_t)triCount, 0);
+		int keptCount = 0;
+		const LONG* pIndices = indices.GetArray();
+		for (int t = 0; t < triCount; ++t)
+		{
+			const float* p[3] = { &world[pIndices[t * 3 + 0] * 3], &world[pIndices[t * 3 + 1] * 3], &world[pIndices[t * 3 + 2] * 3] };
+			float c[3];
+			float r = 0.0f;
+			for (int k = 0; k < 3; ++k)
+				c[k] = (p[0][k] + p[1][k] + p[2][k]) * (1.0f / 3.0f);
+			for (int v = 0; v < 3; ++v)
+				r = max(r, sqrt((p[v][0] - c[0]) * (p[v][0] - c[0]) + (p[v][1] - c[1]) * (p[v][1] - c[1]) + (p[v][2] - c[2]) * (p[v][2] - c[2])));
+			if (pCuller->SphereMatters(c, r))
+			{
+				keep[t] = 1;
+				keptCount++;
+			}
+		}
+
+		Application().LogMessage(CString("Occlusion mesh culling kept ") + CountText(keptCount) + CString(" of ") + CountText(triCount) + CString(" triangles, discarded ") + CountText(triCount - keptCount) + CString(": ") + occluder.name, siInfoMsg);
+		if (keptCount == 0)
+			return MeshRef();
+		if (keptCount < triCount)
+		{
+			MeshRef culled(BuildCulledMesh(verts, indices, keep, keptCount));
+			renderer.add_mesh(culled.Get(), Mat2AT(tm));
+			return culled;
+		}
+	}
+
+	MeshRef mesh = meshes.Find(hash);
+	if (mesh.Get() != 0)
+	{
+		Application().LogMessage(CString("Reusing occlusion mesh with the same geometry for: ") + occluder.name, siInfoMsg);
+	}
+	else
+	{
+		triangle_mesh* pMesh = new triangle_mesh();
+		mesh = MeshRef(pMesh);
+		pMesh->set_num_vertices(vertCount);
+		pMesh->set_num_triangle_faces(triCount);
+
+		// triangle_mesh only takes a vertex at a time, so the doubles are converted on the way in (and the bounds taken)
+		float boundsMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+		float boundsMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		const double* pVerts = verts.GetArray();
+		int positionCount = min(vertCount, (int)(verts.GetCount() / 3));
+		for (int i = 0; i < positionCount; i++, pVerts += 3)
+		{
+			float p[3] = { (float)pVerts[0], (float)pVerts[1], (float)pVerts[2] };
+			pMesh->set_vertex_position(i, p[0], p[1], p[2]);
+			for (int k = 0; k < 3; ++k)
+			{
+				boundsMin[k] = min(boundsMin[k], p[k]);
+				boundsMax[k] = max(boundsMax[k], p[k]);
+			}
+		}
+		const LONG* pIndices = indices.GetArray();
+		for (int i = 0; i < triCount; i++, pIndices += 3)
+		{
+			pMesh->set_face(i, pIndices[0], pIndices[1], pIndices[2]);
+		}
+
+		// TODO: optionally pull this data from a custom property on the mesh
+		pMesh->set_visible_to_camera(true);
+		pMesh->set_visible_to_lights(true);
+
+		meshes.Store(hash, mesh, boundsMin, boundsMax);
+	}
+	meshes.StoreName(occluder.cacheKey, hash, occluder.frame, occluder.renderID);
+
+	renderer.add_mesh(mesh.Get(), Mat2AT(tm));
+
+	return mesh;
+}
+
+bool IsRenderVisible(SceneItem& obj)
+{
+	g_sceneGuard.NoteRead("visibility");
+	Property visProp;
+	CStatus res = obj.GetPropertyFromName("Visibility", visProp);
+	if (res.Succeeded())
+	{
+		bool renderVisible = visProp.GetParameterValue("rendvis");
+		return renderVisible;
+	}
+	return false;
+}
+
+/*
+The objects a render needs out of the scene: the point clouds, the members of the occlusion and light groups,
+and whether they are render visible. Walking every model of a big scene for its point clouds takes a while, so the walk
+is only done when the index is first used or its members can't be trusted anymore: different models or group names,
+a dirty list that holds a model, a group or a cloud/mesh/light the index doesn't know about (any of which could mean
+new members), or a new render without a dirty list, since anything could have been added since the last one.
+Otherwise the point clouds are kept, across frames too: only the visibility of indexed objects in the dirty list is
+looked at again, or when the frame changed or there's no dirty list (the frames of a sequence render) the visibility
+of all of them and the group members, which are cheap to read and can change from frame to frame.
+Each object is in there once, however many nested models it's found through.
+*/
+class SceneIndex
+{
+protected:
+	struct Entry
+	{
+		CRef ref;
+		bool visible;
+	};
+	typedef map<string, Entry> Entries; // by full name, what dirty list items are named after
+	Entries pointClouds;
+	Entries occluders;  // polygon meshes in the occlusion group
+	Entries groupLights;
+	vector<CString> skippedOccluders; // occlusion group members that aren't polygon meshes
+
+	bool built;
+	CString sceneKey;      // names of the models the scene was walked from
+	CString occlusionGroup;
+	CString lightGroup;
+	double frame;
+	ULONG renderID;
+
+	static void Add(Entries& entries, X3DObject& obj)
+	{
+		string name = obj.GetFullName().GetAsciiString();
+		if (entries.count(name) != 0)
+			return; // already found through another model
+		Entry& entry  = entries[name];
+		entry.ref     = obj.GetRef();
+		entry.visible = IsRenderVisible(obj);
 	}
-	else if (shader == 5)
+
+	void Build(const CRefArray& scene)
 	{
-		// this one sucks....
-		shader_marschner shader;
-		shader.set_specular_glossiness(prop.GetParameter("SpecularGlossiness").GetValue());
-		shader.set_specular_level(prop.GetParameter("SpecularLevel").GetValue());
-		shader.set_specular_shift(prop.GetParameter("SpecularShift").GetValue());
+		pointClouds.clear();
+		for (int i=0; i < scene.GetCount(); i++)
+		{
+			CRef ref(scene[i]);
+			if (ref.IsA(siX3DObjectID) == false)
+				continue;
 
-		shader.set_secondary_specular_glossiness(prop.GetParameter("SecondarySpecularGlossiness").GetValue());
-		shader.set_secondary_specular_level(prop.GetParameter("SecondarySpecularLevel").GetValue());
-		shader.set_secondary_specular_shift(prop.GetParameter("SecondarySpecularShift").GetValue());
+			X3DObject obj(ref);
+			CRefArray pointCloudRefs = obj.FindChildren2(CString(), L"pointcloud", CStringArray(), true);
+			for (int j=0; j < pointCloudRefs.GetCount(); ++j)
+			{
+				X3DObject child(pointCloudRefs[j]);
+				Add(pointClouds, child);
+			}
+		}
+		ReadGroups(scene);
+		built = true;
 
-		shader.set_glint_level(prop.GetParameter("GlintLevel").GetValue());
-		shader.set_glint_size(prop.GetParameter("GlintSize").GetValue());
-		shader.set_glint_glossiness(prop.GetParameter("GlintGlossiness").GetValue());
+		Application().LogMessage(CString("Indexed scene: ") + CountText(pointClouds.size()) + CString(" point clouds, ") +
+			CountText(occluders.size()) + CString(" occlusion meshes, ") + CountText(groupLights.size()) + CString(" group lights"), siInfoMsg);
+	}
 
-		shader.set_diffuse_level(prop.GetParameter("DiffuseLevel").GetValue());
+	void ReadGroups(const CRefArray& scene)
+	{
+		occluders.clear();
+		groupLights.clear();
+		skippedOccluders.clear();
+		for (int i=0; i < scene.GetCount(); i++)
+		{
+			Model model(scene[i]); // we can't find groups with FindChildren2 which is super annoying, we have to pull from the scene root model
+			if (model.IsValid() == false)
+				continue;
+			CRefArray groups = model.GetGroups();
+			for (int j=0; j < groups.GetCount(); j++)
+			{
+				Group group(groups[j]);
+				bool occlusion = group.GetName() == occlusionGroup;
+				if (occlusion == false && group.GetName() != lightGroup)
+					continue;
 
-		shader.use_specular_glossiness_channel(prop.GetParameter("UseSpecularGlossinessChannel").GetValue());
-		shader.use_specular_level_channel(prop.GetParameter("UseSpecularLevelChannel").GetValue());
-		shader.use_specular_shift_channel(prop.GetParameter("UseSpecularShiftChannel").GetValue());
+				CRefArray groupMembers = group.GetMembers();
+				for (int k=0; k < groupMembers.GetCount(); k++)
+				{
+					X3DObject member(groupMembers[k]);
+					if (occlusion == false)
+					{
+						Light light(groupMembers[k]);
+						if (light.IsValid())
+							Add(groupLights, member);
+					}
+					else if (member.GetType() == CString("polymsh"))
+						Add(occluders, member);
+					else
+						skippedOccluders.push_back(member.GetFullName());
+				}
+			}
+		}
+	}
 
-		shader.use_secondary_specular_glossiness_channel(prop.GetParameter("UseSecondarySpecularGlossinessChannel").GetValue());
-		shader.use_secondary_specular_level_channel(prop.GetParameter("UseSecondarySpecularLevelChannel").GetValue());
-		shader.use_secondary_specular_shift_channel(prop.GetParameter("UseSecondarySpecularShiftChannel").GetValue());
+	// reads the visibility of every point cloud and the group members again, false if a point cloud is gone
+	bool Refresh(const CRefArray& scene)
+	{
+		for (Entries::iterator i = pointClouds.begin(); i != pointClouds.end(); ++i)
+		{
+			X3DObject obj(i->second.ref);
+			if (obj.IsValid() == false)
+				return false;
+			i->second.visible = IsRenderVisible(obj);
+		}
+		ReadGroups(scene);
+		return true;
+	}
 
-		shader.use_glint_level_channel(prop.GetParameter("UseGlintLevelChannel").GetValue());
-		shader.use_glint_size_channel(prop.GetParameter("UseGlintSizeChannel").GetValue());
-		shader.use_glint_glossiness_channel(prop.GetParameter("UseGlintGlossinessChannel").GetValue());
+	// the entry the dirty object is or belongs to (its properties and primitives are named after it), or 0
+	static Entry* FindOwner(Entries& entries, const CString& name)
+	{
+		string owner = name.GetAsciiString();
+		for (;;)
+		{
+			Entries::iterator pos = entries.find(owner);
+			if (pos != entries.end())
+				return &pos->second;
+			size_t dot = owner.rfind('.');
+			if (dot == string::npos)
+				return 0;
+			owner.erase(dot);
+		}
+	}
 
-		shader.use_diffuse_level_channel(prop.GetParameter("UseDiffuseLevelChannel").GetValue());
+	// false if the dirty list holds something that could change what's in the index
+	bool Patch(const CRefArray& dirtyList)
+	{
+		for (LONG i = 0; i < dirtyList.GetCount(); ++i)
+		{
+			const CRef& ref = dirtyList[i];
+			CString name = ref.GetAsText();
+			Entry* pEntry = FindOwner(pointClouds, name);
+			if (pEntry == 0)
+				pEntry = FindOwner(occluders, name);
+			if (pEntry == 0)
+				pEntry = FindOwner(groupLights, name);
+			if (pEntry != 0)
+			{
+				X3DObject obj(pEntry->ref);
+				if (obj.IsValid() == false)
+					return false; // deleted
+				pEntry->visible = IsRenderVisible(obj);
+				continue;
+			}
 
-		renderer.set_shader(&shader);
+			if (ref.IsA(siModelID) || ref.IsA(siGroupID) || ref.IsA(siLightID))
+				return false;
+			if (ref.IsA(siX3DObjectID))
+			{
+				X3DObject obj(ref);
+				CString type = obj.GetType();
+				if (type == CString("pointcloud") || type == CString("polymsh"))
+					return false;
+			}
+		}
+		return true;
 	}
-}
 
-triangle_mesh* AddOcclusionMesh(krakatoa_renderer& renderer, X3DObject& obj3d)
-{
-	Primitive& prim = obj3d.GetActivePrimitive();  // should be a polygon mesh
-	PolygonMesh geom = prim.GetGeometry();
-	if (geom.IsValid() == false)
+	static void GetVisible(const Entries& entries, vector<CRef>& refs)
 	{
-		Application().LogMessage(CString("Object is not a polygon mesh: ") + obj3d.GetName(), siWarningMsg);
-		return 0;
+		refs.clear();
+		for (Entries::const_iterator i = entries.begin(); i != entries.end(); ++i)
+		{
+			if (i->second.visible)
+				refs.push_back(i->second.ref);
+		}
 	}
-	CGeometryAccessor ga = geom.GetGeometryAccessor();
-	triangle_mesh* pMesh = new triangle_mesh();
-
-	int triCount = ga.GetTriangleCount();
-	int vertCount = ga.GetVertexCount();
-	CLongArray indices;
-	ga.GetTriangleVertexIndices(indices);
-	CDoubleArray verts;
-	ga.GetVertexPositions(verts);
 
-	pMesh->set_num_vertices(verts.GetCount());
-	pMesh->set_num_triangle_faces(indices.GetCount());
+public:
+	SceneIndex() :
+		built(false),
+		frame(0.0),
+		renderID(0)
+	{
+	}
 
-	for (int i = 0; i < vertCount; i++)
+	// brings the index up to date for this render, the dirty list is only used when it covers everything since the last one.
+	// renderID tells the frames of one render apart from a new render, which could follow any change to the scene
+	void Update(const CRefArray& scene, const CRefArray& dirtyList, bool dirtyListTrusted, ULONG renderID, const CString& occlusionGroupName, const CString& lightGroupName, double frame)
 	{
-		pMesh->set_vertex_position(i, (float)verts[i * 3 + 0], (float)verts[i * 3 + 1], (float)verts[i * 3 + 2]);
+		g_sceneGuard.NoteRead("scene index");
+		CString key;
+		for (LONG i = 0; i < scene.GetCount(); ++i)
+			key += scene[i].GetAsText() + CString(";");
+
+		bool rebuild = built == false || key != sceneKey || occlusionGroupName != occlusionGroup || lightGroupName != lightGroup ||
+			(dirtyListTrusted == false && renderID != this->renderID);
+		bool frameChanged = frame != this->frame;
+
+		sceneKey       = key;
+		occlusionGroup = occlusionGroupName;
+		lightGroup     = lightGroupName;
+		this->frame    = frame;
+		this->renderID = renderID;
+		if (rebuild == false && dirtyListTrusted && Patch(dirtyList) == false)
+			rebuild = true;
+		if (rebuild == false && (dirtyListTrusted == false || frameChanged) && Refresh(scene) == false)
+			rebuild = true;
+		if (rebuild)
+			Build(scene);
 	}
-	for (int i = 0; i < triCount; i++)
+
+	void Clear()
 	{
-		pMesh->set_face(i, indices[i * 3 + 0], indices[i * 3 + 1], indices[i * 3 + 2]);
+		built = false;
+		pointClouds.clear();
+		occluders.clear();
+		groupLights.clear();
+		skippedOccluders.clear();
 	}
 
+	void GetPointClouds(vector<CRef>& refs) const { GetVisible(pointClouds, refs); }
+	void GetOccluders(vector<CRef>& refs) const { GetVisible(occluders, refs); }
+	void GetGroupLights(vector<CRef>& refs) const { GetVisible(groupLights, refs); }
+	const vector<CString>& GetSkippedOccluders() const { return skippedOccluders; }
+};
 
-	// TODO: optionally pull this data from a custom property on the mesh
-	pMesh->set_visible_to_camera(true);
-	pMesh->set_visible_to_lights(true);
+static SceneIndex g_sceneIndex; // lives for the whole session
 
-	renderer.add_mesh(pMesh, Mat2AT(obj3d.GetKinematics().GetGlobal().GetTransform().GetMatrix4()));
+// the Krakatoa Options that only go into renderer settings, they get set again before every render so the particles,
+// meshes and lights a session already gave krakatoa don't have to change with them
+static const char* const g_inPlaceSettings[] = {
+	"ErrorOnMissingLicense", "AttenuationLookupFilter", "AttenuationLookupFilterSize", "DrawPointFilter", "DrawPointFilterSize",
+	"VoxelRadius", "VoxelSize", "BackgroundR", "BackgroundG", "BackgroundB",
+	"DensityPerParticle", "DensityExponent", "EmissionStrength", "EmissionExponent", "LightingDensityPerParticle", "LightingDensityExponent",
+	"CameraBlur", "UseDepthOfField", "FStop", "FocalLength", "FocalDistance", "SampleRate",
+	"ShutterBegin", "ShutterEnd", "MBSamples", "Jitter", "OccludedRGBA", "ZDepth", "ExrCompression",
+	"ViewerUpdateRate", "ProgressivePreview", "PreviewPassScale", 0 };
 
-	return pMesh;
+bool IsInPlaceSetting(const string& name)
+{
+	for (int i = 0; g_inPlaceSettings[i] != 0; ++i)
+		if (name == g_inPlaceSettings[i])
+			return true;
+	return false;
 }
 
-// This class ensures the render data is unlocked safely no matter how the render function exists
-// create on the stack, then when it goes out of scope it cleans up if it needs to 
-class LockRendererData
+/*
+What stays alive between siRenderFramePreview renders (render region, preview) while interactive sessions are on.
+Krakatoa SR can't take a single light, mesh or stream back out of a renderer, but it reads its streams again on every
+render and every setting can be set again. So when all that changed since the last render are settings from
+g_inPlaceSettings, shaders, or the render camera while nothing that was ingested depends on it (no culling, merging or
+occluder culling and ICE doesn't read the camera), the renderer isn't reset: the streams, meshes and lights of the last
+render stay in it and only the settings and camera are applied before rendering again. Anything else (another frame,
+a changed object or light, any other option) resets the renderer and refills it, with the point clouds the dirty list
+leaves alone coming out of the particle cache instead of ICE.
+*/
+class PreviewSession
 {
 protected:
-	Renderer& renderer;
-	bool locked;
+	krakatoa_renderer* pRenderer;
+	map<string, CString> settings; // Krakatoa Options parameter values from the last render
+	ULONG sessionID;
+
+	// what the renderer still holds from the last render, Process takes it with Resume and gives it back with Keep
+	bool resident;
+	vector<SIPointCloudParticleStream*> streams;
+	vector<PassParticleStream*> passStreams; // all expired, but krakatoa keeps every one added since the reset
+	vector<MeshRef> meshes;
+	float foldedDensity;
+	float lodFraction;
+	int inPlaceRenders;
+
+	// what the last render was of, to tell if the resident particles still fit
+	double frame;
+	CString viewKey;
+	LONG lightCount;
+
+	SINoSave idleSave; // the renderer is left pointing at this instead of the saver of a finished render
 
 public:
-	LockRendererData(Renderer& renderer) :
-		renderer(renderer),
-		locked(false)
+	// every in place render leaves a few expired pass streams in the renderer, it starts over once in a while to drop them
+	static const int MAX_IN_PLACE_RENDERS = 64;
+
+	PreviewSession() :
+		pRenderer(0),
+		sessionID(0),
+		resident(false),
+		foldedDensity(1.0f),
+		lodFraction(1.0f),
+		inPlaceRenders(0),
+		frame(0.0),
+		lightCount(0)
 	{
+	}
 
+	~PreviewSession()
+	{
+		delete pRenderer; // too late to log anything
 	}
 
-	CStatus lock()
+	// stands in for the render ID in the particle cache, previews of one session all follow the same dirty lists
+	ULONG GetID() const
 	{
-		if (locked == false)
+		return 0x80000000 | sessionID;
+	}
+
+	krakatoa_renderer& GetRenderer()
+	{
+		if (pRenderer == 0)
 		{
-			CStatus res = renderer.LockSceneData();
-			if (res == CStatus::OK)
-				locked = true;
-			return res;
+			Application().LogMessage("Starting interactive Krakatoa session", siInfoMsg);
+			pRenderer = new krakatoa_renderer();
+			sessionID++;
 		}
-		return CStatus::OK;
+		return *pRenderer;
 	}
 
-	CStatus unlock()
+	// true when the renderer can render what it holds again with the new settings, logs why it can't otherwise.
+	// cameraName is the render camera, viewKey and lightCount describe the frame size, crop and lights of this render
+	bool CanRenderInPlace(Property& prop, const CRefArray& dirtyList, const CString& cameraName, double frame, const CString& viewKey, LONG lightCount)
 	{
-		if (locked)
+		CString reason;
+		int changed = 0;
+		CParameterRefArray params = prop.GetParameters();
+		for (LONG i = 0; i < params.GetCount(); ++i)
 		{
-			CStatus res = renderer.UnlockSceneData();
-			if (res == CStatus::OK)
+			Parameter param(params[i]);
+			string name = param.GetScriptName().GetAsciiString();
+			CString value = param.GetValue().GetAsText();
+			map<string, CString>::iterator pos = settings.find(name);
+			if (pos != settings.end() && pos->second != value)
 			{
-				locked = false;
+				changed++;
+				if (reason.IsEmpty() && IsInPlaceSetting(name) == false)
+					reason = param.GetScriptName() + CString(" changed");
 			}
-			return res;
+			settings[name] = value;
 		}
-		return CStatus::OK;
+
+		bool sameFrame = frame == this->frame;
+		bool sameView  = viewKey == this->viewKey;
+		bool sameLights = lightCount == this->lightCount;
+		this->frame      = frame;
+		this->viewKey    = viewKey;
+		this->lightCount = lightCount;
+		if (resident == false)
+			return false;
+
+		// culling, merging and occluder culling all work from the camera and the crop window
+		bool cameraFree = (LONG)prop.GetParameter("CullingMode").GetValue() == 0 && (bool)prop.GetParameter("MergeDenseParticles").GetValue() == false &&
+			((bool)prop.GetParameter("UseOcclusionMeshes").GetValue() == false || (bool)prop.GetParameter("CullOcclusionMeshes").GetValue() == false) &&
+			(bool)prop.GetParameter("ICEReadsCamera").GetValue() == false;
+		if (reason.IsEmpty() && sameFrame == false)
+			reason = "the frame changed";
+		if (reason.IsEmpty() && sameLights == false)
+			reason = "the lights changed";
+		if (reason.IsEmpty() && sameView == false && cameraFree == false)
+			reason = "the frame size or region changed and the particles were picked for the old one";
+		if (reason.IsEmpty() && inPlaceRenders >= MAX_IN_PLACE_RENDERS)
+			reason = CString("it was rendered in place ") + CValue((LONG)inPlaceRenders).GetAsText() + CString(" times");
+		CString propName = prop.GetFullName();
+		for (LONG i = 0; i < dirtyList.GetCount() && reason.IsEmpty(); ++i)
+		{
+			CString name = dirtyList[i].GetAsText();
+			if (IsUnder(name, propName) || dirtyList[i].IsA(siShaderID) || (cameraFree && IsUnder(name, cameraName)))
+				continue;
+			reason = name + CString(" changed");
+		}
+
+		if (reason.IsEmpty() == false)
+		{
+			Application().LogMessage(CString("Refilling the interactive Krakatoa session, ") + reason, siInfoMsg);
+			return false;
+		}
+		Application().LogMessage(CString("Rendering the interactive Krakatoa session in place, ") + CValue((LONG)changed).GetAsText() + CString(" settings changed"), siInfoMsg);
+		return true;
 	}
 
+	// hands what the renderer holds to Process for an in place render
+	void Resume(vector<SIPointCloudParticleStream*>& streams, vector<PassParticleStream*>& passStreams, vector<MeshRef>& meshes, float& foldedDensity, float& lodFraction)
+	{
+		this->streams.swap(streams);
+		this->passStreams.swap(passStreams);
+		this->meshes.swap(meshes);
+		foldedDensity = this->foldedDensity;
+		lodFraction   = this->lodFraction;
+		resident = false;
+		inPlaceRenders++;
+	}
 
-	~LockRendererData()
+	// takes what the renderer holds after a finished render instead of resetting it. the renderer is pointed away from the
+	// callbacks on Process's stack, an idle renderer doesn't call them but they're gone before the next render sets them again
+	void Keep(krakatoa_renderer& renderer, vector<SIPointCloudParticleStream*>& streams, vector<PassParticleStream*>& passStreams, vector<MeshRef>& meshes, float foldedDensity, float lodFraction)
 	{
-		unlock(); // ensure unlocked happens when this object goes out of scope
+		for (vector<PassParticleStream*>::iterator i = passStreams.begin(); i != passStreams.end(); ++i)
+			(*i)->Expire();
+		for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+			(*i)->close();
+		renderer.set_progress_logger_update(0);
+		renderer.set_frame_buffer_update(0);
+		renderer.set_cancel_render_callback(0);
+		renderer.set_render_save_callback(&idleSave);
+
+		// the session holds nothing here, Process either resumed it or released it before filling the renderer
+		this->streams.swap(streams);
+		this->passStreams.swap(passStreams);
+		this->meshes.swap(meshes);
+		this->foldedDensity = foldedDensity;
+		this->lodFraction   = lodFraction;
+		resident = true;
+	}
+
+	// empties the renderer, the next render fills it again
+	void Release()
+	{
+		if (pRenderer != 0 && resident)
+			pRenderer->reset_renderer();
+		for (vector<PassParticleStream*>::iterator i = passStreams.begin(); i != passStreams.end(); ++i)
+			delete *i;
+		passStreams.clear();
+		for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+			delete *i;
+		streams.clear();
+		meshes.clear();
+		resident = false;
+		inPlaceRenders = 0;
+	}
+
+	void End()
+	{
+		Release();
+		if (pRenderer != 0)
+		{
+			Application().LogMessage("Ending interactive Krakatoa session", siInfoMsg);
+			delete pRenderer;
+			pRenderer = 0;
+		}
+		settings.clear();
+		viewKey = CString();
 	}
 };
 
+const int PreviewSession::MAX_IN_PLACE_RENDERS;
 
-bool IsRenderVisible(SceneItem& obj)
+static PreviewSession g_previewSession;
+
+/*
+Puts the renderer back the way Process found it on every way out, early returns and exceptions included.
+The session's renderer outlives Process, so it must not keep pointing at the streams, meshes, saver
+and the presenter and logger on Process's stack. Create it after those so it runs before they go away.
+A finished session render is kept instead (see PreviewSession::Keep), the session takes the streams and meshes.
+*/
+class RenderCleanup
 {
-	Property visProp;
-	CStatus res = obj.GetPropertyFromName("Visibility", visProp);
-	if (res.Succeeded())
+protected:
+	krakatoa_renderer& renderer;
+	vector<SIPointCloudParticleStream*>& streams;
+	vector<PassParticleStream*>& passStreams;
+	vector<MeshRef>& meshes;
+	multi_channel_exr_file_saver*& pSaver;
+	bool done;
+	bool keep;
+	float foldedDensity;
+	float lodFraction;
+
+public:
+	RenderCleanup(krakatoa_renderer& renderer, vector<SIPointCloudParticleStream*>& streams, vector<PassParticleStream*>& passStreams, vector<MeshRef>& meshes, multi_channel_exr_file_saver*& pSaver) :
+		renderer(renderer),
+		streams(streams),
+		passStreams(passStreams),
+		meshes(meshes),
+		pSaver(pSaver),
+		done(false),
+		keep(false),
+		foldedDensity(1.0f),
+		lodFraction(1.0f)
 	{
-		bool renderVisible = visProp.GetParameterValue("rendvis");
-		return renderVisible;
 	}
-	return false;
-}
+
+	~RenderCleanup()
+	{
+		Run();
+	}
+
+	// hands the renderer's contents to the session when Run comes, with what the densities were scaled by for them
+	void Keep(float foldedDensity, float lodFraction)
+	{
+		keep = true;
+		this->foldedDensity = foldedDensity;
+		this->lodFraction   = lodFraction;
+	}
+
+	void Run()
+	{
+		if (done)
+			return;
+		done = true;
+
+		if (keep)
+			g_previewSession.Keep(renderer, streams, passStreams, meshes, foldedDensity, lodFraction);
+		else
+			renderer.reset_renderer(); // reset render to drop progress logger, meshes, lights, etc
+
+		for (vector<PassParticleStream*>::iterator i = passStreams.begin(); i != passStreams.end(); ++i)
+			delete *i;
+		passStreams.clear();
+		for (vector<SIPointCloudParticleStream*>::iterator i = streams.begin(); i != streams.end(); ++i)
+			delete *i;
+		streams.clear();
+
+		meshes.clear(); // the renderer has been reset (or the session has them) so nothing here points at the meshes anymore
+		g_occlusionMeshCache.Sweep();
+
+		delete pSaver;
+		pSaver = 0;
+	}
+};
 
 SICALLBACK XSILoadPlugin( PluginRegistrar& in_reg )
 {
@@ -860,11 +4545,15 @@ SICALLBACK KrakatoaSR_Init( CRef& in_context )
 SICALLBACK KrakatoaSR_Term( CRef &in_ctxt )
 {
     g_shouldAbort = false;
+    g_previewSession.End();
+    g_particleCache.Clear();
+    g_occlusionMeshCache.Clear();
+    g_sceneIndex.Clear();
 
 	return  CStatus::OK;
 }
 
-SICALLBACK KrakatoaSR_Process( CRef& in_context )
+CStatus RenderFrame( CRef& in_context )
 { 
 	g_shouldAbort = false;
 
@@ -919,12 +4608,23 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
     Application().LogMessage(CString(L"Render Type: ") + renderType, siInfoMsg);
     Application().LogMessage(CString(L"Using Camera: ") + cameraName,siInfoMsg);
 
-	krakatoasr::krakatoa_renderer krakatoa; // locally scoped
-   
-       
     CTime evalTime = context.GetTime();
     Property& rendererProp = context.GetRendererProperty( evalTime );
 
+	// interactive previews hang on to the renderer and their particles, everything else starts from scratch
+	bool previewSession = process == siRenderFramePreview && (bool)rendererProp.GetParameter("InteractiveSession").GetValue();
+	if (previewSession == false)
+		g_previewSession.End();
+	// a session renders what it already holds again when only settings changed, otherwise it's emptied and filled like any other render
+	CString viewKey = CValue((LONG)imageWidth).GetAsText() + L"x" + CValue((LONG)imageHeight).GetAsText() + L" " + CValue((LONG)cropLeft).GetAsText() + L"," +
+		CValue((LONG)cropBottom).GetAsText() + L" " + CValue((LONG)cropWidth).GetAsText() + L"x" + CValue((LONG)cropHeight).GetAsText();
+	bool inPlace = previewSession && g_previewSession.CanRenderInPlace(rendererProp, dirtyList, cameraObj.GetFullName(), evalTime.GetTime(), viewKey, lights.GetCount());
+	if (previewSession && inPlace == false)
+		g_previewSession.Release();
+
+	krakatoasr::krakatoa_renderer localRenderer; // locally scoped
+	krakatoasr::krakatoa_renderer& krakatoa = previewSession ? g_previewSession.GetRenderer() : localRenderer;
+
 	bool outputPrt = rendererProp.GetParameter("OutputPrt").GetValue();
 	bool actuallydOutputPrt = outputPrt && renderType != CString("Region");
 	bool actuallyRenderImage = !actuallydOutputPrt;
@@ -975,11 +4675,35 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
 
     SetShaderFromProperty(krakatoa, rendererProp); // must happen before particle add
 
-    SIProgressLogger logger(context);
+	// region renders only render the middle of the frame that holds the crop window, with the camera narrowed down to it.
+	// the window stays centred on the frame so the camera only needs a narrower fov (or ortho width), the crop is
+	// copied out of it by the presenter. each side is twice the furthest the crop reaches from the middle of the frame,
+	// which keeps the same parity as the frame so the window lands on whole pixels
+	bool renderCropOnly = renderType == CString("Region") && actuallyRenderImage && cropWidth > 0 && cropHeight > 0 && (cropWidth < imageWidth || cropHeight < imageHeight);
+	unsigned int renderWidth  = imageWidth;
+	unsigned int renderHeight = imageHeight;
+	if (renderCropOnly)
+	{
+		renderWidth  = (unsigned int)max((int)imageWidth - 2 * (int)cropLeft, 2 * (int)(cropLeft + cropWidth) - (int)imageWidth);
+		renderHeight = (unsigned int)max((int)imageHeight - 2 * (int)cropBottom, 2 * (int)(cropBottom + cropHeight) - (int)imageHeight);
+		renderWidth  = min(renderWidth, imageWidth);
+		renderHeight = min(renderHeight, imageHeight);
+		renderCropOnly = renderWidth < imageWidth || renderHeight < imageHeight; // a crop reaching an edge needs the whole frame
+	}
+	unsigned int renderLeft   = (imageWidth - renderWidth) / 2;
+	unsigned int renderBottom = (imageHeight - renderHeight) / 2;
+	float cropScaleX = (float)renderWidth / imageWidth;
+
+    ViewerPresenter presenter(context, cropWidth, cropHeight, cropLeft, cropBottom, renderLeft, renderBottom, rendererProp.GetParameter("ViewerUpdateRate").GetValue());
+    SIProgressLogger logger(presenter);
     SICancelRenderInterface canceler;
-    SIFrameBufferInterface frameBufferInterface(context, cropWidth, cropHeight, cropLeft, cropBottom);
+    SIFrameBufferInterface frameBufferInterface(presenter);
     SINoSave noSave;
     multi_channel_exr_file_saver* pSaver = 0;
+    vector<SIPointCloudParticleStream*> pStreamInterfaces;
+    vector<PassParticleStream*> passStreams; // what the renderer reads the streams through in progressive previews
+    vector<MeshRef> meshRefs; // one per mesh added to the renderer, they have to outlive its reset
+    RenderCleanup cleanup(krakatoa, pStreamInterfaces, passStreams, meshRefs, pSaver);
         
      //add the file saver to the renderer
     if (renderType != CString("Region") && fileOutput && outputPrt == false)
@@ -1044,7 +4768,7 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
 	if (actuallyRenderImage)
 	{
 		// only set this stuff up if we actually going to render
-		krakatoa.set_render_resolution(imageWidth, imageHeight);
+		krakatoa.set_render_resolution(renderWidth, renderHeight);
 		krakatoa.set_frame_buffer_update(&frameBufferInterface);
 	}
         
@@ -1056,6 +4780,33 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
     float pixelAspect = camPrim.GetParameter("pixelratio").GetValue();
     int   projType    = camPrim.GetParameter("proj").GetValue();    // 0 = orthographic 1 = perspective
 
+	// culling uses the same camera as krakatoa, restricted to the crop window on region renders
+	int cullingMode = rendererProp.GetParameter("CullingMode").GetValue(); // 0 = off, 1 = camera only (keeps shadow casters), 2 = camera frustum
+	if (actuallydOutputPrt)
+		cullingMode = 0; // the .prt file gets every particle
+	CameraCuller culler;
+	culler.SetMargin(rendererProp.GetParameter("CullingMargin").GetValue());
+	MATH::CMatrix4 camTM = camera.GetKinematics().GetGlobal().GetTransform().GetMatrix4();
+	float windowLeft   = -1.0f;
+	float windowRight  =  1.0f;
+	float windowBottom = -1.0f;
+	float windowTop    =  1.0f;
+	if (renderType == CString("Region"))
+	{
+		windowLeft   = 2.0f * cropLeft / imageWidth - 1.0f;
+		windowRight  = 2.0f * (cropLeft + cropWidth) / imageWidth - 1.0f;
+		windowBottom = 2.0f * cropBottom / imageHeight - 1.0f;
+		windowTop    = 2.0f * (cropBottom + cropHeight) / imageHeight - 1.0f;
+	}
+	// merging works in cells of about a pixel (or however many the option says) as seen from the camera
+	MergeGrid mergeGrid;
+	float mergeCellPixels = rendererProp.GetParameter("MergeCellSize").GetValue();
+	bool mergeParticles = actuallydOutputPrt == false && (bool)rendererProp.GetParameter("MergeDenseParticles").GetValue() && mergeCellPixels > 0.0f;
+	// krakatoa keeps the horizontal fov (or ortho width) it's given below and the pixel aspect (pixel width over height, same as
+	// softimage's pixelratio) only changes how much of the frame fits vertically: the frame is imageWidth * pixelAspect wide
+	// for every imageHeight, so its height is the width's times imageHeight / (imageWidth * pixelAspect)
+	float heightScale = (float)imageHeight / imageWidth / (pixelAspect > 0.0f ? pixelAspect : 1.0f);
+
     if (projType == 0) // orthographic camera
     {
         krakatoa.set_camera_type( CAMERA_ORTHOGRAPHIC );
@@ -1063,7 +4814,9 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
         float orthoHeight = camPrim.GetParameter("orthoheight").GetValue();
         float orthoWidth  = ((float)imageWidth) * orthoHeight / ((float)imageHeight);
         
-        krakatoa.set_camera_orthographic_width(orthoWidth);
+        krakatoa.set_camera_orthographic_width(orthoWidth * cropScaleX);
+		culler.SetOrthographic(camTM, orthoWidth * 0.5f, orthoWidth * 0.5f * heightScale, windowLeft, windowRight, windowBottom, windowTop, nearPlane, farPlane);
+		mergeGrid.SetOrthographic(camTM, orthoWidth / imageWidth, mergeCellPixels);
     }
     else // perspective camera
     {
@@ -1073,18 +4826,28 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
         int fovType = camPrim.GetParameter("fovtype").GetValue(); // 0 = vertical, 1 = horizontal
     
 
+        float hfovRadians;
         if (fovType == 1)
-            krakatoa.set_camera_perspective_fov(fov * 3.1415926535897932384626433832795028841f / 180.0f); // expected horizontal fov in RADIANS!
+            hfovRadians = fov * 3.1415926535897932384626433832795028841f / 180.0f;
         else
         {
             // fov is vertical, need to convert to horizontal
             float hfov = ((float)imageWidth) * fov / ((float)imageHeight);
-            krakatoa.set_camera_perspective_fov(hfov * 3.1415926535897932384626433832795028841f / 180.0f); // expected horizontal fov in RADIANS!
+            hfovRadians = hfov * 3.1415926535897932384626433832795028841f / 180.0f;
         }
+		float tanHalfWidth = tan(hfovRadians * 0.5f);
+        krakatoa.set_camera_perspective_fov(2.0f * atan(tanHalfWidth * cropScaleX)); // expected horizontal fov in RADIANS!
+
+		culler.SetPerspective(camTM, tanHalfWidth, tanHalfWidth * heightScale, windowLeft, windowRight, windowBottom, windowTop, nearPlane, farPlane);
+		mergeGrid.SetPerspective(camTM, 2.0f * tanHalfWidth / imageWidth, mergeCellPixels, nearPlane);
     }
 
     krakatoa.set_camera_clipping(nearPlane, farPlane);
     krakatoa.set_pixel_aspect_ratio(pixelAspect);
+
+	if (renderCropOnly)
+		Application().LogMessage(CString(L"Rendering the middle ") + CValue((LONG)renderWidth).GetAsText() + L"x" + CValue((LONG)renderHeight).GetAsText() +
+			L" of the frame for the " + CValue((LONG)cropWidth).GetAsText() + L"x" + CValue((LONG)cropHeight).GetAsText() + L" region", siInfoMsg);
 	
 	
 	if (outputPrt)
@@ -1155,134 +4918,263 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
 		}
 	}
 
-    vector<SIPointCloudParticleStream*> pStreamInterfaces;
-    vector<triangle_mesh*> meshPtrs;
+    vector<OccluderSnapshot> occluders;
+    float foldedDensity = 1.0f; // what FoldConstantChannels multiplied the densities by
+    float lodFraction   = 1.0f; // the fraction of the particles level of detail kept
+
+    ParticleStreamOptions streamOptions;
+    streamOptions.pipelined   = rendererProp.GetParameter("PipelinedIngestion").GetValue();
+    streamOptions.packThreads = rendererProp.GetParameter("IngestionThreads").GetValue();
+    // previews can start with a quick pass at a fraction of the resolution, the full pass reads the same streams again through new pass streams
+    int previewPassScale = 1;
+    if (process == siRenderFramePreview && actuallyRenderImage && (bool)rendererProp.GetParameter("ProgressivePreview").GetValue())
+        previewPassScale = max(1, (int)rendererProp.GetParameter("PreviewPassScale").GetValue());
+    streamOptions.pCuller = cullingMode != 0 ? &culler : 0;
+    streamOptions.pMergeGrid      = mergeParticles ? &mergeGrid : 0;
+    streamOptions.mergeMaxPerCell = rendererProp.GetParameter("MergeMaxPerCell").GetValue();
+    streamOptions.rejectEmpty       = rendererProp.GetParameter("RejectEmptyParticles").GetValue();
+    streamOptions.rejectTransparent = rendererProp.GetParameter("RejectTransparentParticles").GetValue();
+    streamOptions.emissionEnabled   = rendererProp.GetParameter("UseEmission").GetValue();
+    streamOptions.additiveMode      = rendererProp.GetParameter("AdditiveMode").GetValue();
+    streamOptions.halfPrecision     = (int)rendererProp.GetParameter("ChannelPrecision").GetValue() == 1;
+    if (actuallydOutputPrt == false) // a saved prt keeps every channel
+        GetUnusedChannels(rendererProp, streamOptions.unusedChannels);
+    if (previewSession || (bool)rendererProp.GetParameter("CacheParticles").GetValue())
+    {
+        g_particleCache.SetMaxBytes((size_t)(LONG)rendererProp.GetParameter("ParticleCacheSize").GetValue() * 1024 * 1024);
+        streamOptions.pCache = &g_particleCache;
+    }
+    else
+    {
+        g_particleCache.Clear(); // give the memory back
+    }
+    // the copy lets the scene go before the render, it's off by default since it holds as much memory again as the ICE data.
+    // a cache or a session keeps the particles past the render, so they need the copy anyway
+    streamOptions.snapshot = streamOptions.pCache != 0 || (bool)rendererProp.GetParameter("UnlockSceneEarly").GetValue();
+    int lodMode = actuallydOutputPrt ? 0 : (int)rendererProp.GetParameter("ParticleLOD").GetValue(); // a saved prt keeps every particle
+    streamOptions.fetchIDs = lodMode != 0;
+    streamOptions.frame    = evalTime.GetTime();
+    streamOptions.renderID = previewSession ? g_previewSession.GetID() : renderID;
+    vector<LightPlacement> lightPlacements;
 
     bool useOcclusionMeshes    = rendererProp.GetParameter("UseOcclusionMeshes").GetValue();
+    // the cache still shares meshes between instances within a render when nothing is kept between them
+    OcclusionMeshCache renderMeshes;
+    OcclusionMeshCache& meshCache = useOcclusionMeshes && (bool)rendererProp.GetParameter("CacheOcclusionMeshes").GetValue() ? g_occlusionMeshCache : renderMeshes;
+    if (&meshCache != &g_occlusionMeshCache)
+        g_occlusionMeshCache.Clear();
     CString occlusionGroupName = rendererProp.GetParameter("OcclusionMeshGroupName").GetValue();
     bool useLightGroup         = rendererProp.GetParameter("UseLightGroup").GetValue();
     CString lightGroupName     = rendererProp.GetParameter("LightGroupName").GetValue();
     
-    for (int i=0; i < scene.GetCount(); i++)
+    // the dirty list only covers interactive region renders, anywhere else a cached cloud is fetched and copied out of ICE
+    // again and only kept if it turns out the same (see FinishSnapshot)
+    bool dirtyListTrusted = renderType == CString("Region") || previewSession;
+    if (streamOptions.pCache != 0 && dirtyListTrusted == false)
+        Application().LogMessage("Cached particles are only reused without reading ICE for region renders and interactive previews", siInfoMsg);
+    // moving the render camera leaves cached clouds and meshes alone unless the user says an ICE tree reads it
+    CString trustedCamera = (bool)rendererProp.GetParameter("ICEReadsCamera").GetValue() ? CString() : cameraObj.GetFullName();
+    if (inPlace)
+    {
+        // the renderer still holds the streams, meshes and lights, they only get a new camera and settings
+        g_previewSession.Resume(pStreamInterfaces, passStreams, meshRefs, foldedDensity, lodFraction);
+    }
+    else
     {
-        CRef ref(scene[i]);
-        if (ref.IsA(siX3DObjectID))
+        g_sceneIndex.Update(scene, dirtyList, dirtyListTrusted, streamOptions.renderID, useOcclusionMeshes ? occlusionGroupName : CString(), useLightGroup ? lightGroupName : CString(), evalTime.GetTime());
+
+        vector<CRef> indexed;
+        g_sceneIndex.GetPointClouds(indexed);
+        for (vector<CRef>::iterator i = indexed.begin(); i != indexed.end(); ++i)
         {
-            X3DObject obj(ref);
-            CRefArray& pointClouds = obj.FindChildren2(CString(), L"pointcloud",CStringArray(), true);
-            for (int j=0; j < pointClouds.GetCount(); ++j)
+            X3DObject child(*i);
+            Primitive& prim = child.GetActivePrimitive();
+            Geometry& geom = prim.GetGeometry();
+            if (geom.GetPoints().GetCount() == 0)
             {
-                X3DObject child( pointClouds[j] );
-				if (IsRenderVisible(child))
-				{
-					Primitive& prim = child.GetActivePrimitive();
-					bool valid = prim.IsValid();
-					Geometry& geom = prim.GetGeometry();
-					valid = geom.IsValid();
-					if (geom.GetPoints().GetCount() == 0)
-					{
-						Application().LogMessage(CString("Skipping point cloud since particle count is 0: ") + child.GetFullName(), siInfoMsg);
-					}
-					else
-					{
-						Application().LogMessage(CString("Adding particle stream from point cloud: ") + child.GetFullName(), siInfoMsg);
-						SIPointCloudParticleStream* pStream = new SIPointCloudParticleStream(geom);
-						pStreamInterfaces.push_back(pStream);
-						krakatoa.add_particle_stream(particle_stream::create_from_particle_stream_interface(pStream));
-					}
-				}
+                Application().LogMessage(CString("Skipping point cloud since particle count is 0: ") + child.GetFullName(), siInfoMsg);
+            }
+            else
+            {
+                Application().LogMessage(CString("Adding particle stream from point cloud: ") + child.GetFullName(), siInfoMsg);
+                streamOptions.cacheKey     = child.GetFullName().GetAsciiString();
+                streamOptions.cacheTrusted = dirtyListTrusted && IsObjectUnchanged(dirtyList, child.GetFullName(), rendererProp.GetFullName(), trustedCamera);
+                SIPointCloudParticleStream* pStream = new SIPointCloudParticleStream(geom, streamOptions);
+                pStreamInterfaces.push_back(pStream); // added to krakatoa once we know about all the lights
             }
+        }
+        SnapshotParticleStreams(pStreamInterfaces);
 
-            if (useOcclusionMeshes || useLightGroup)
+        if (useOcclusionMeshes)
+        {
+            g_sceneIndex.GetOccluders(indexed);
+            occluders.resize(indexed.size());
+            for (size_t i = 0; i < indexed.size(); ++i)
             {
+                X3DObject obj3d(indexed[i]);
+                bool unchanged = dirtyListTrusted && IsObjectUnchanged(dirtyList, obj3d.GetFullName(), rendererProp.GetFullName(), trustedCamera);
+                ReadOcclusionMesh(obj3d, occluders[i], meshCache, unchanged, streamOptions.frame, streamOptions.renderID); // added once the lights and particles are known
+            }
+            const vector<CString>& skipped = g_sceneIndex.GetSkippedOccluders();
+            for (vector<CString>::const_iterator i = skipped.begin(); i != skipped.end(); ++i)
+                Application().LogMessage(CString("skipping object in occlusion group (it is not a polygon mesh): ") + *i, siWarningMsg);
+        }
 
-                Model model(ref); // we can't find groups with FindChildren2 which is super annoying, we have to pull from the scene root model
-                if (model.IsValid())
-                {
-                    CRefArray& groups = model.GetGroups();
-                    for (int j=0; j < groups.GetCount(); j++)
-                    {
-                        Group group(groups[j]);
-                        if (useOcclusionMeshes && group.GetName() == occlusionGroupName)
-                        {
-                            CRefArray& groupMembers = group.GetMembers();
-                            for (int k=0; k < groupMembers.GetCount(); k++)
-                            {
-                                X3DObject gchild(groupMembers[k]);
-                                const char* gchildName = gchild.GetName().GetAsciiString();
-                                if (gchild.GetType() == CString("polymsh"))
-                                {
-                                    triangle_mesh* pMesh = AddOcclusionMesh(krakatoa, gchild);
-                                    if (pMesh != 0)
-                                    {
-                                        Application().LogMessage(CString("Added occlusion mesh: ") + gchild.GetName(), siInfoMsg);
-                                        meshPtrs.push_back(pMesh);
-                                    }
-                                }
-                                else
-                                {
-                                    Application().LogMessage(CString("skipping object in occlusion group (it is not a polygon mesh): ") + gchild.GetFullName(), siWarningMsg);
-                                }
-                            }
-                        }
-                        else if (method == METHOD_PARTICLE && useLightGroup && group.GetName() == lightGroupName)
-                        {
-                            CRefArray& groupMembers = group.GetMembers();
-                            for (int k=0; k < groupMembers.GetCount(); k++)
-                            {
-                                Light light(groupMembers[k]);
-								if (light.IsValid() && IsRenderVisible(light))
-                                {
-                                    AddLight(krakatoa, light);
-                                }
-                            }
-                        }
-                    }
-                }
+        if (method == METHOD_PARTICLE && useLightGroup)
+        {
+            g_sceneIndex.GetGroupLights(indexed);
+            for (vector<CRef>::iterator i = indexed.begin(); i != indexed.end(); ++i)
+            {
+                Light light(*i);
+                AddLight(krakatoa, light, &lightPlacements);
             }
         }
-    }
     
-    if (method == METHOD_PARTICLE && useLightGroup == false) // voxel mode errors if you add lights
-    {
-        // add all scene lights since we are not using a light group
-        for (int i=0; i < lights.GetCount(); ++i)
+        if (method == METHOD_PARTICLE && useLightGroup == false) // voxel mode errors if you add lights
         {
-            CRef& ref = lights[i];
-            Light light(ref);
-            bool valid = light.IsValid();
-			if (light.IsValid() && IsRenderVisible(light))
-			{
-				AddLight(krakatoa, light);
-			}
+            // add all scene lights since we are not using a light group
+            for (int i=0; i < lights.GetCount(); ++i)
+            {
+                CRef& ref = lights[i];
+                Light light(ref);
+                bool valid = light.IsValid();
+    			if (light.IsValid() && IsRenderVisible(light))
+    			{
+    				AddLight(krakatoa, light, &lightPlacements);
+    			}
+            }
         }
     }
-       
-    // Unlock the scene data *before* we start rendering and sending tile data back.
-	// we are done querying the scene
-	if (locker.unlock() != CStatus::OK)
+
+	// the rest of the settings the particles and meshes need, nothing reads the scene past the unlock below
+	bool foldConstants          = (bool)rendererProp.GetParameter("FoldConstantChannels").GetValue();
+	float baseDensity           = (float)rendererProp.GetParameter("DensityPerParticle").GetValue();
+	float baseLightingDensity   = (float)rendererProp.GetParameter("LightingDensityPerParticle").GetValue();
+	float baseEmissionStrength  = (float)rendererProp.GetParameter("EmissionStrength").GetValue();
+	float lodRatio              = (float)rendererProp.GetParameter("LODRatio").GetValue();
+	LONG lodBudget              = (LONG)rendererProp.GetParameter("LODBudget").GetValue();
+	bool cullOccluders          = (bool)rendererProp.GetParameter("CullOcclusionMeshes").GetValue() && occluders.empty() == false;
+
+	// the particles and meshes were copied out of the scene, so Softimage can have it back before any of the work on them.
+	// streams that still read ICE's arrays keep it locked until the render is done and the locker goes
+	if (streamOptions.snapshot && locker.unlock() != CStatus::OK)
 		return CStatus::Abort;
 
-    context.NewFrame( imageWidth, imageHeight );
+	if (inPlace == false)
+	{
+		// the prt should hold every channel ICE gave us, so nothing gets folded away when saving one
+		if (actuallydOutputPrt == false && foldConstants)
+			foldedDensity = FoldConstantChannels(krakatoa, baseDensity, baseLightingDensity, pStreamInterfaces);
+
+		// now that the lights are known the streams can work out which particles matter
+		if (cullingMode == 1)
+			culler.KeepShadowCasters(lightPlacements);
+		for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
+		{
+			(*i)->AppendChannels();
+			(*i)->SelectParticles();
+		}
 
-    try
-    {
-        bool successful = krakatoa.render();
-        krakatoa.reset_renderer(); // reset render to drop progress logger, meshes, lights, etc
-        
-        for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
-            delete *i;
-        pStreamInterfaces.clear();
+		// level of detail drops particles across all the clouds and makes up for them in the global density and emission
+		lodFraction = ApplyParticleLOD(lodMode, lodRatio, lodBudget, pStreamInterfaces);
+
+		// occluders only matter where the camera can see them or where they can shadow the particles
+		// (merged particles stay inside the bounds of the ones they replace, so the bounds can be taken before merging)
+		OccluderCuller occluderCuller(culler, lightPlacements);
+		if (cullOccluders)
+		{
+			float boundsMin[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+			float boundsMax[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+			for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
+				(*i)->AccumulateBounds(boundsMin, boundsMax);
+			if (boundsMin[0] <= boundsMax[0])
+				occluderCuller.SetParticleBounds(boundsMin, boundsMax);
+		}
+		for (vector<OccluderSnapshot>::iterator i = occluders.begin(); i != occluders.end(); ++i)
+		{
+			MeshRef mesh = AddOcclusionMesh(krakatoa, *i, meshCache, cullOccluders ? &occluderCuller : 0);
+			if (mesh.Get() != 0)
+			{
+				Application().LogMessage(CString("Added occlusion mesh: ") + i->name, siInfoMsg);
+				meshRefs.push_back(mesh);
+			}
+		}
 
-        for (vector<triangle_mesh*>::iterator i = meshPtrs.begin(); i != meshPtrs.end(); ++i)
-            delete *i;
-        meshPtrs.clear();
+		// merging keeps the total density and emission in each cell, so it doesn't need any compensation
+		for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
+			(*i)->MergeDenseCells();
 
-        if (pSaver != 0)
+		for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
 		{
-            delete pSaver;
-			pSaver = 0;
+			SIPointCloudParticleStream* pStream = *i;
+			if (pStream->particle_count() == 0)
+				pStream->close();
+			else if (previewPassScale == 1 && previewSession == false) // progressive previews and sessions add pass streams for each render instead
+				krakatoa.add_particle_stream(particle_stream::create_from_particle_stream_interface(pStream));
 		}
+	}
+
+	// folded density and level of detail were worked out for the particles, an in place render scales the new settings the same way
+	float densityPerParticle = baseDensity * foldedDensity / lodFraction;
+	float lightingDensity    = baseLightingDensity * foldedDensity / lodFraction;
+	float emissionStrength   = baseEmissionStrength / lodFraction;
+	if (foldedDensity != 1.0f || lodFraction < 1.0f)
+	{
+		krakatoa.set_density_per_particle(densityPerParticle);
+		krakatoa.set_lighting_density_per_particle(lightingDensity);
+		krakatoa.set_emission_strength(emissionStrength);
+	}
+
+    context.NewFrame( imageWidth, imageHeight );
+
+    try
+    {
+        bool successful = true;
+        if (previewPassScale > 1)
+        {
+            // the preview pass only gets fraction of the particles, but each of its pixels covers 1/fraction as much of the frame,
+            // so in particle mode a pixel still gets about as many particles as in the full pass and density and emission stay.
+            // the lights' attenuation maps don't get any coarser though, so the lighting density makes up for the missing
+            // particles, and in voxel mode (the voxels keep their size) so does everything else
+            float fraction = 1.0f / (previewPassScale * previewPassScale);
+            float pixelScale = method == METHOD_PARTICLE ? 1.0f : 1.0f / fraction;
+            for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
+                (*i)->SetSubset(fraction);
+            AddPassStreams(krakatoa, pStreamInterfaces, passStreams);
+            krakatoa.set_density_per_particle(densityPerParticle * pixelScale);
+            krakatoa.set_lighting_density_per_particle(lightingDensity / fraction);
+            krakatoa.set_emission_strength(emissionStrength * pixelScale);
+            krakatoa.set_render_resolution((renderWidth + previewPassScale - 1) / previewPassScale, (renderHeight + previewPassScale - 1) / previewPassScale);
+            krakatoa.set_render_save_callback(&noSave);
+            frameBufferInterface.SetUpscaleSize(renderWidth, renderHeight);
+
+            Application().LogMessage(CString(L"Rendering 1/") + CValue((LONG)previewPassScale).GetAsText() + L" resolution preview pass", siInfoMsg);
+            successful = krakatoa.render() && g_shouldAbort == false;
+
+            for (vector<PassParticleStream*>::iterator i = passStreams.begin(); i != passStreams.end(); ++i)
+                (*i)->Expire();
+            for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
+            {
+                (*i)->close();
+                (*i)->SetSubset(1.0f);
+            }
+            AddPassStreams(krakatoa, pStreamInterfaces, passStreams); // fresh ones for the full pass, reading the same streams
+            krakatoa.set_density_per_particle(densityPerParticle);
+            krakatoa.set_lighting_density_per_particle(lightingDensity);
+            krakatoa.set_emission_strength(emissionStrength);
+            krakatoa.set_render_resolution(renderWidth, renderHeight);
+            if (pSaver != 0)
+                krakatoa.set_render_save_callback(pSaver);
+            frameBufferInterface.SetUpscaleSize(0, 0);
+        }
+        if (successful && previewSession && previewPassScale == 1)
+            AddPassStreams(krakatoa, pStreamInterfaces, passStreams); // the renderer keeps them, so a kept session can still read its streams again
+        if (successful)
+            successful = krakatoa.render();
+        if (successful && previewSession && actuallyRenderImage)
+            cleanup.Keep(foldedDensity, lodFraction); // the next preview may render the same particles in place
+        cleanup.Run();
+        presenter.Finish(); // the final image has to be in the viewer before we return
 
         if (successful == false) // if we get a false but no exception, the use canceled, it was not a real error
         {
@@ -1295,29 +5187,26 @@ SICALLBACK KrakatoaSR_Process( CRef& in_context )
     catch (std::exception& ex)
     {
         Application().LogMessage(CString("Karkatoa rendering failed: ") + CString(ex.what()), siErrorMsg);
-    
-        krakatoa.reset_renderer(); // reset render to drop progress logger, etc
-
-        for (vector<SIPointCloudParticleStream*>::iterator i = pStreamInterfaces.begin(); i != pStreamInterfaces.end(); ++i)
-            delete *i;
-        pStreamInterfaces.clear();
-
-        for (vector<triangle_mesh*>::iterator i = meshPtrs.begin(); i != meshPtrs.end(); ++i)
-            delete *i;
-        meshPtrs.clear();
-
-        if (pSaver != 0)
-		{
-            delete pSaver;
-			pSaver = 0;
-		}
-
-        return CStatus::Fail;
+        return CStatus::Fail; // cleanup resets the renderer on the way out
     }
     
     return CStatus::OK;
 }
 
+SICALLBACK KrakatoaSR_Process( CRef& in_context )
+{
+	// anything thrown outside the render itself (a scene read after the unlock for one) fails the render instead of reaching softimage
+	try
+	{
+		return RenderFrame(in_context);
+	}
+	catch (std::exception& ex)
+	{
+		Application().LogMessage(CString("Karkatoa rendering failed: ") + CString(ex.what()), siErrorMsg);
+		return CStatus::Fail;
+	}
+}
+
 SICALLBACK KrakatoaSR_Cleanup( CRef& in_context )
 { 
     Application().LogMessage("KrakatoaSR Cleanup",siInfoMsg);
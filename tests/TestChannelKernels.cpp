@@ -0,0 +1,225 @@
+// Checks the channel copy and pack kernels against what they should write into krakatoa's records.
+// Returns the number of failed checks, 0 when everything passes.
+
+#include "KrakatoaKernels.h"
+
+#include <cstdio>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { printf("%s(%d): failed %s\n", __FILE__, __LINE__, #condition); g_failures++; } } while (0)
+
+static const size_t STRIDE = 32;       // record stride, with the padding the pack kernels may spill into
+static const unsigned char FILL = 0xCD; // what the records hold before the kernels run
+
+ChannelCopier MakeCopier(ChannelCopyFunc copy, ChannelPackFunc pack, const void* pSource, size_t sourceStride, int byteOffset, int dataSize)
+{
+	ChannelCopier copier;
+	copier.copy         = copy;
+	copier.pack         = pack;
+	copier.pSource      = (const char*)pSource;
+	copier.sourceStride = sourceStride;
+	copier.byteOffset   = byteOffset;
+	copier.dataSize     = dataSize;
+	copier.pDataArray   = 0;
+	return copier;
+}
+
+float RecordFloat(const std::vector<char>& records, size_t record, int offset)
+{
+	float value;
+	memcpy(&value, &records[record * STRIDE + offset], sizeof(value));
+	return value;
+}
+
+unsigned short RecordHalf(const std::vector<char>& records, size_t record, int offset)
+{
+	unsigned short value;
+	memcpy(&value, &records[record * STRIDE + offset], sizeof(value));
+	return value;
+}
+
+// the bytes in front of the channel are never written, and past it only the 4 bytes a 16 byte store can spill into
+bool UntouchedOutside(const std::vector<char>& records, size_t count, int offset, int dataSize, int spill)
+{
+	for (size_t r = 0; r < count; ++r)
+	{
+		for (size_t b = 0; b < STRIDE; ++b)
+		{
+			bool inside = (int)b >= offset && (int)b < offset + dataSize + spill;
+			if (inside == false && (unsigned char)records[r * STRIDE + b] != FILL)
+				return false;
+		}
+	}
+	return true;
+}
+
+void TestCopyDirect()
+{
+	// a Color4 goes in as just its rgb
+	float colors[2][4] = { { 0.1f, 0.2f, 0.3f, 0.4f }, { 1.0f, 2.0f, 3.0f, 4.0f } };
+	ChannelCopier copier = MakeCopier(&CopyChannelDirect<float, 3>, 0, colors, sizeof(colors[0]), 8, 3 * sizeof(float));
+	std::vector<char> record(STRIDE, (char)FILL);
+	copier.copy(copier, 1, &record[0]);
+	CHECK(RecordFloat(record, 0, 8) == 1.0f);
+	CHECK(RecordFloat(record, 0, 12) == 2.0f);
+	CHECK(RecordFloat(record, 0, 16) == 3.0f);
+	CHECK(UntouchedOutside(record, 1, 8, 12, 0));
+}
+
+void TestPackFloat1()
+{
+	const int count = 11; // two groups of 4 and a tail
+	float values[count];
+	for (int i = 0; i < count; ++i)
+		values[i] = i * 1.5f - 3.0f;
+	ChannelCopier copier = MakeCopier(&CopyChannelDirect<float, 1>, &PackChannelFloat1, values, sizeof(float), 4, sizeof(float));
+
+	const int first = 2;
+	std::vector<char> records(STRIDE * (count - first), (char)FILL);
+	copier.pack(copier, first, count - first, &records[0], STRIDE);
+	for (int i = 0; i < count - first; ++i)
+		CHECK(RecordFloat(records, i, 4) == values[first + i]);
+	CHECK(UntouchedOutside(records, count - first, 4, 4, 0));
+}
+
+void TestPackFloatN()
+{
+	const int count = 6;
+	float vectors[count][3];
+	for (int i = 0; i < count; ++i)
+		for (int k = 0; k < 3; ++k)
+			vectors[i][k] = i * 10.0f + k;
+	ChannelCopier copier = MakeCopier(&CopyChannelDirect<float, 3>, &PackChannelFloatN<3>, vectors, sizeof(vectors[0]), 12, 3 * sizeof(float));
+
+	std::vector<char> records(STRIDE * count, (char)FILL);
+	copier.pack(copier, 0, count, &records[0], STRIDE);
+	for (int i = 0; i < count; ++i)
+		for (int k = 0; k < 3; ++k)
+			CHECK(RecordFloat(records, i, 12 + k * 4) == vectors[i][k]);
+	CHECK(UntouchedOutside(records, count, 12, 12, 4));
+	// the last particle is a plain copy so the source array is never read past its end, and nothing spills
+	CHECK((unsigned char)records[(count - 1) * STRIDE + 24] == FILL);
+}
+
+void TestPackConstantAndGeneric()
+{
+	const float constant[3] = { 7.0f, 8.0f, 9.0f };
+	ChannelCopier copier = MakeCopier(&CopyChannelDirect<float, 3>, &PackChannelConstant, constant, 0, 0, 3 * sizeof(float));
+	std::vector<char> records(STRIDE * 5, (char)FILL);
+	copier.pack(copier, 3, 5, &records[0], STRIDE);
+	for (int i = 0; i < 5; ++i)
+		CHECK(RecordFloat(records, i, 0) == 7.0f && RecordFloat(records, i, 4) == 8.0f && RecordFloat(records, i, 8) == 9.0f);
+	CHECK(UntouchedOutside(records, 5, 0, 12, 0));
+
+	int ints[4] = { 5, -6, 7, -8 };
+	copier = MakeCopier(&CopyChannelDirect<int, 1>, &PackChannelGeneric, ints, sizeof(int), 20, sizeof(int));
+	std::fill(records.begin(), records.end(), (char)FILL);
+	copier.pack(copier, 1, 3, &records[0], STRIDE);
+	for (int i = 0; i < 3; ++i)
+	{
+		int value;
+		memcpy(&value, &records[i * STRIDE + 20], sizeof(value));
+		CHECK(value == ints[1 + i]);
+	}
+	CHECK(UntouchedOutside(records, 3, 20, 4, 0));
+}
+
+KRAKATOA_TARGET_F16C unsigned short HardwareFloatToHalf(float value)
+{
+	return (unsigned short)_mm_extract_epi16(_mm_cvtps_ph(_mm_set1_ps(value), _MM_FROUND_TO_NEAREST_INT), 0);
+}
+
+void TestHalfConversions()
+{
+	// every half that isn't a NaN comes back out of a float unchanged
+	int roundTripFailures = 0;
+	for (unsigned int h = 0; h < 0x10000; ++h)
+	{
+		bool nan = (h & 0x7C00) == 0x7C00 && (h & 0x3FF) != 0;
+		if (nan == false && FloatToHalf(HalfToFloat((unsigned short)h)) != h)
+			roundTripFailures++;
+	}
+	CHECK(roundTripFailures == 0);
+
+	CHECK(FloatToHalf(1.0f) == 0x3C00);
+	CHECK(FloatToHalf(-2.0f) == 0xC000);
+	CHECK(FloatToHalf(65504.0f) == 0x7BFF);
+	CHECK(FloatToHalf(1e6f) == 0x7C00);             // overflows to Inf
+	CHECK(FloatToHalf(5.960464477539063e-8f) == 1); // smallest denormal
+	CHECK(FloatToHalf(2.98e-8f) == 0);              // rounds down to 0
+	CHECK((FloatToHalf(sqrtf(-1.0f)) & 0x7FFF) == 0x7E00);
+
+	// the scalar conversion has to match the F16C instruction it stands in for
+	if (g_hasF16C)
+	{
+		int mismatches = 0;
+		for (unsigned long long bits = 0; bits <= 0xFFFFFFFFull; bits += 4099)
+		{
+			float value;
+			unsigned int b = (unsigned int)bits;
+			memcpy(&value, &b, sizeof(value));
+			if (value != value)
+				continue; // NaN payloads are allowed to differ
+			unsigned short hardware = HardwareFloatToHalf(value);
+			if (FloatToHalf(value) != hardware)
+				mismatches++;
+		}
+		CHECK(mismatches == 0);
+	}
+	else
+	{
+		printf("no F16C on this cpu, only the scalar half path was tested\n");
+	}
+}
+
+void TestPackHalf()
+{
+	const int count = 9;
+	float scalars[count];
+	float vectors[count][3];
+	for (int i = 0; i < count; ++i)
+	{
+		scalars[i] = i * 0.37f - 1.0f;
+		for (int k = 0; k < 3; ++k)
+			vectors[i][k] = i * 3.1f + k * 0.01f;
+	}
+
+	ChannelCopier copier = MakeCopier(&CopyChannelHalf<1>, &PackChannelHalf1, scalars, sizeof(float), 6, sizeof(unsigned short));
+	std::vector<char> records(STRIDE * count, (char)FILL);
+	copier.pack(copier, 0, count, &records[0], STRIDE);
+	for (int i = 0; i < count; ++i)
+		CHECK(RecordHalf(records, i, 6) == FloatToHalf(scalars[i]));
+	CHECK(UntouchedOutside(records, count, 6, 2, 0));
+
+	copier = MakeCopier(&CopyChannelHalf<3>, &PackChannelHalfN<3>, vectors, sizeof(vectors[0]), 10, 3 * sizeof(unsigned short));
+	std::fill(records.begin(), records.end(), (char)FILL);
+	copier.pack(copier, 0, count, &records[0], STRIDE);
+	for (int i = 0; i < count; ++i)
+		for (int k = 0; k < 3; ++k)
+			CHECK(RecordHalf(records, i, 10 + k * 2) == FloatToHalf(vectors[i][k]));
+	CHECK(UntouchedOutside(records, count, 10, 6, 2));
+
+	// the single particle copy writes the same halves
+	std::vector<char> record(STRIDE, (char)FILL);
+	copier.copy(copier, 4, &record[0]);
+	for (int k = 0; k < 3; ++k)
+		CHECK(RecordHalf(record, 0, 10 + k * 2) == FloatToHalf(vectors[4][k]));
+}
+
+int main()
+{
+	TestCopyDirect();
+	TestPackFloat1();
+	TestPackFloatN();
+	TestPackConstantAndGeneric();
+	TestHalfConversions();
+	TestPackHalf();
+	if (g_failures == 0)
+		printf("all channel kernel checks passed\n");
+	return g_failures;
+}
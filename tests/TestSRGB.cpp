@@ -0,0 +1,107 @@
+// Checks the sRGB tables the viewer conversions use against the exact sRGB curve.
+// Returns the number of failed checks, 0 when everything passes.
+
+#include "KrakatoaKernels.h"
+
+#include <cstdio>
+#include <cmath>
+#include <cfloat>
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { printf("%s(%d): failed %s\n", __FILE__, __LINE__, #condition); g_failures++; } } while (0)
+
+// the sRGB encoding in double precision, scaled to maxCode and rounded
+int ExactSRGB(double v, int maxCode)
+{
+	v = v > 0.0 ? (v < 1.0 ? v : 1.0) : 0.0;
+	double encoded = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+	return (int)floor(encoded * maxCode + 0.5);
+}
+
+bool WithinOne(int value, int exact)
+{
+	return value >= exact - 1 && value <= exact + 1;
+}
+
+float FloatFromBits(unsigned int bits)
+{
+	float v;
+	memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+void TestCoarseTables(const SRGBTable& table)
+{
+	for (int i = 0; i <= SRGBTable::COARSE_SIZE; ++i)
+	{
+		double v = (double)i / SRGBTable::COARSE_SIZE;
+		CHECK(WithinOne(table.coarse[i], ExactSRGB(v, 255)));
+		CHECK(WithinOne(table.srgb16[i], ExactSRGB(v, 65535)));
+	}
+	CHECK(table.srgb16[SRGBTable::COARSE_SIZE + 1] == table.srgb16[SRGBTable::COARSE_SIZE]);
+}
+
+void TestThresholds(const SRGBTable& table)
+{
+	CHECK(table.thresholds[0] == 0.0f);
+	for (int code = 1; code < 256; ++code)
+	{
+		float threshold = table.thresholds[code];
+		unsigned int bits;
+		memcpy(&bits, &threshold, sizeof(bits));
+		float below = FloatFromBits(bits - 1);
+
+		// the threshold is the first float of its code, the float before it still belongs to the code below
+		CHECK(table.thresholds[code] > table.thresholds[code - 1]);
+		CHECK(WithinOne(code, ExactSRGB(threshold, 255)));
+		CHECK(WithinOne(code - 1, ExactSRGB(below, 255)));
+		CHECK(table.ToSRGB(threshold) == code);
+		CHECK(table.ToSRGB(below) == code - 1);
+	}
+	CHECK(table.thresholds[256] > 1.0f);
+}
+
+// every 101st float between 0 and 1, against the pow version and the exact curve
+void TestConversions(const SRGBTable& table)
+{
+	int mismatches = 0;
+	int off8 = 0;
+	int off16 = 0;
+	for (unsigned int bits = 0; bits <= 0x3F800000; bits += 101)
+	{
+		float v = FloatFromBits(bits);
+		unsigned char code = table.ToSRGB(v);
+		if (code != linearToSRGB(v))
+			mismatches++;
+		if (WithinOne(code, ExactSRGB(v, 255)) == false)
+			off8++;
+		if (WithinOne(table.ToSRGB16(v), ExactSRGB(v, 65535)) == false)
+			off16++;
+	}
+	CHECK(mismatches == 0);
+	CHECK(off8 == 0);
+	CHECK(off16 == 0);
+
+	// out of range values clamp, NaN goes to black
+	CHECK(table.ToSRGB(-1.0f) == 0);
+	CHECK(table.ToSRGB(1.0f) == 255);
+	CHECK(table.ToSRGB(FLT_MAX) == 255);
+	CHECK(table.ToSRGB(sqrtf(-1.0f)) == 0);
+	CHECK(table.ToSRGB16(-1.0f) == 0);
+	CHECK(table.ToSRGB16(1.0f) == 65535);
+	CHECK(table.ToSRGB16(FLT_MAX) == 65535);
+	CHECK(table.ToSRGB16(sqrtf(-1.0f)) == 0);
+}
+
+int main()
+{
+	static const SRGBTable table;
+	TestCoarseTables(table);
+	TestThresholds(table);
+	TestConversions(table);
+	if (g_failures == 0)
+		printf("all sRGB table checks passed\n");
+	return g_failures;
+}
@@ -0,0 +1,86 @@
+// Checks the scene read guard on its own: it counts reads while the scene is locked and throws on reads after the unlock.
+// The plugin needs the Softimage SDK so its reads can't be run here, this doesn't show that every one of them goes
+// through the guard, only what happens to the ones that do.
+// Returns the number of failed checks, 0 when everything passes.
+
+#include "KrakatoaKernels.h"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+static int g_failures = 0;
+
+#define CHECK(condition) \
+	do { if (!(condition)) { printf("%s(%d): failed %s\n", __FILE__, __LINE__, #condition); g_failures++; } } while (0)
+
+// true when the read threw and the error names what was read
+bool ReadThrows(SceneReadGuard& guard, const char* what)
+{
+	try
+	{
+		guard.NoteRead(what);
+	}
+	catch (std::runtime_error& ex)
+	{
+		return strstr(ex.what(), what) != NULL;
+	}
+	return false;
+}
+
+void TestBeforeLock()
+{
+	SceneReadGuard guard;
+	CHECK(guard.IsLocked() == false);
+	CHECK(ReadThrows(guard, "light"));
+	CHECK(guard.GetReads() == 0);
+}
+
+void TestLockedReads()
+{
+	SceneReadGuard guard;
+	guard.Lock();
+	CHECK(guard.IsLocked());
+	CHECK(ReadThrows(guard, "ICE attributes") == false);
+	CHECK(ReadThrows(guard, "ICE attribute data") == false);
+	CHECK(ReadThrows(guard, "visibility") == false);
+	CHECK(guard.GetReads() == 3);
+}
+
+void TestReadAfterUnlock()
+{
+	SceneReadGuard guard;
+	guard.Lock();
+	guard.NoteRead("scene index");
+	guard.Unlock();
+	CHECK(guard.IsLocked() == false);
+	CHECK(ReadThrows(guard, "ICE attribute chunk"));
+	CHECK(ReadThrows(guard, "occlusion mesh"));
+
+	// the failed reads aren't counted, the count from the lock stays for the log
+	CHECK(guard.GetReads() == 1);
+}
+
+void TestRelock()
+{
+	SceneReadGuard guard;
+	guard.Lock();
+	guard.NoteRead("light");
+	guard.NoteRead("light");
+	guard.Unlock();
+	guard.Lock();
+	CHECK(guard.GetReads() == 0);
+	CHECK(ReadThrows(guard, "light") == false);
+	CHECK(guard.GetReads() == 1);
+}
+
+int main()
+{
+	TestBeforeLock();
+	TestLockedReads();
+	TestReadAfterUnlock();
+	TestRelock();
+	if (g_failures == 0)
+		printf("all scene read guard checks passed\n");
+	return g_failures;
+}